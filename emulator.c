@@ -32,58 +32,200 @@
    - simulator stops when no events are left rather than stopping as
    soon as n packets are sent.
    - fixed C style to adhere to current programming style
+   - any number of flows (A/B pairs) share the channel in each direction;
+   the event list is a heap and timers are found without a search
+   - simulated time is a 64-bit count of ticks (TICKS_PER_UNIT per time
+   unit) so that long runs keep their resolution
+   - optional time-series sampling of protocol and channel state
+   - optional cycle counts per event type, handler and event list operation
+   - optional conservative parallel simulation (PDES)
+   - messages delivered at B are checked against those generated
+   - optional branching of a run into variants with fork()
+   - optional sequential stopping on confidence intervals
+   - saturating, Poisson, on/off and trace file workloads
+   - optional chain of hops and routers from a topology file
+   - a fingerprint of the run, and optional checkpoints of it
+   - optional paired comparison of protocols on common random numbers
 
    ********************************************************************* */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "emulator.h"
 #include "gbn.h"
+#ifndef FORK
+#define FORK 0
+#endif
+#ifndef PRECISION
+#define PRECISION 0
+#endif
+#ifndef BATCHSIZE
+#define BATCHSIZE 0
+#endif
+#ifndef PAIRED
+#define PAIRED 0
+#endif
+#if PRECISION > 0 || PAIRED > 0
+#include <math.h>
+#endif
+#if PDES
+#include <pthread.h>
+#include <sched.h>
+#endif
+#if FORK || (PRECISION > 0 && BATCHSIZE == 0) || PAIRED > 0
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
 
 struct event {
-  float evtime;           /* event time */
+  simtime_t evtime;       /* event time, in ticks */
   int evtype;             /* event type code */
   int eventity;           /* entity where event occurs */
+  int evflow;             /* flow the entity belongs to */
+  unsigned long evseq;    /* insertion order, breaks ties in evtime */
+  int evslot;             /* position of this event in evheap */
+  int evhop;              /* FROM_HOP: the hop the packet goes on next */
   struct pkt *pktptr;     /* ptr to packet (if any) assoc w/ this event */
-  struct event *prev;
-  struct event *next;
 };
 
-struct event *evlist = NULL;   /* the event list */
+/* the event list is a binary min-heap ordered on evtime, so that insertion
+   and removal stay logarithmic however many flows have events pending */
+static SIMLOCAL struct event **evheap = NULL;
+static SIMLOCAL int nevents = 0;      /* number of events in evheap */
+static SIMLOCAL int evheapsize = 0;   /* allocated size of evheap */
+static SIMLOCAL unsigned long nextevseq = 0; /* per thread, like the event list */
+
+static struct event **timers;  /* running timer (or NULL) per flow and entity */
+static uint64_t *entityhash;   /* fingerprint per flow and entity */
+static simtime_t *chanlast;    /* latest arrival scheduled at each entity */
+
+#define MAXPENDING 64     /* accepted but undelivered messages tracked per flow */
+
+/* a message accepted by A and not yet delivered at B */
+struct pending {
+  simtime_t gentime;             /* when it was generated */
+  int id;                        /* its number within the flow, from 0 */
+  uint32_t digest;               /* digest of its data */
+};
+
+/* per flow statistics */
+struct flow {
+  int nsim;                      /* number of messages from 5 to 4 so far */
+  int delivered;                 /* messages delivered to layer 5 at B */
+  struct pending pend[MAXPENDING]; /* messages in flight, oldest first */
+  unsigned pushed, popped;       /* ring buffer of pend, see PEEK */
+  struct pending last;           /* last message delivered */
+  simtime_t latsum;              /* sum of delivery latencies */
+  simtime_t latmax;              /* largest delivery latency */
+  uint64_t rng;                  /* PDES: random stream for arrivals */
+  int blocked;                   /* saturating: A refused the last offer */
+  simtime_t onuntil;             /* on/off: end of the current burst */
+  simtime_t *trace;              /* trace file: arrival times of the flow */
+  int ntrace, tracesize, tracenext;
+  int lastid[26], sends[26];     /* PAIRED: latest message with each letter */
+  int others[2];                 /* PAIRED: other packets sent by A and B */
+};
+
+static struct flow *flows;
+
+/* A's side of a flow fills the pend ring and B's side empties it.  With
+   PDES they can be on different threads, so each reads the other's count
+   atomically.  The ring is never full or empty when they look (a window of
+   messages at most is outstanding), so the answer does not depend on how
+   far the other thread has got. */
+#if PDES
+#define PEEK(v)     __atomic_load_n(&(v), __ATOMIC_RELAXED)
+#define POKE(v, x)  __atomic_store_n(&(v), (x), __ATOMIC_RELAXED)
+#else
+#define PEEK(v)     (v)
+#define POKE(v, x)  ((v) = (x))
+#endif
+
+/* PDES partitions.  Every partition has an event list of its own, in the
+   thread that simulates it; the boxes below carry packets between them */
+struct send {
+  struct event key;              /* event during which the packet was sent */
+  int from;                      /* sending entity */
+  struct pkt packet;
+};
+
+struct partition {
+  struct send *out;              /* packets sent during the current window */
+  int nout, outsize, outpos;
+  struct event **in;             /* arrivals scheduled by the channel */
+  int nin, insize;
+  simtime_t next;                /* earliest event in the partition */
+  simtime_t last;                /* time of the last event simulated */
+  int sums[11];                  /* the thread's statistics, at the end */
+  double gaptime;                /* and its gap_time */
+  long nevents;                  /* and the number of events it simulated */
+#if PDES
+  pthread_t thread;
+#endif
+};
+
+#define NEVER INT64_MAX
+#define OWNER(flow, entity) ((2*(flow) + (entity)) % nparts)
+
+static int nparts = 1;                   /* partitions (threads) */
+static struct partition *parts;
+static SIMLOCAL int inwindow;            /* simulating a window in parallel */
+static SIMLOCAL struct event *curevent;  /* event being simulated */
 
 /* possible events: */
 #define  TIMER_INTERRUPT 0  
 #define  FROM_LAYER5     1
 #define  FROM_LAYER3     2
+#define  FROM_HOP        3    /* a packet reaches a router */
 
 #define  OFF             0
 #define  ON              1
 
 int TRACE = 3;
+int nflows = 1;           /* number of A/B pairs sharing the channel */
+SIMLOCAL int curflow = 0; /* flow of the entity currently being called */
 
 /* statistics updated by GBN */
-int window_full;   /* count of the number of messages dropped due to full window */
-int total_ACKs_received;
-int packets_resent;       /* count of the number of packets resent  */
-int new_ACKs;           /* count of the number of acks correctly received */
-int packets_received;  /* count of the packets received by receiver */
+SIMLOCAL int window_full;   /* count of the number of messages dropped due to full window */
+SIMLOCAL int total_ACKs_received;
+SIMLOCAL int packets_resent;       /* count of the number of packets resent  */
+SIMLOCAL int new_ACKs;           /* count of the number of acks correctly received */
+SIMLOCAL int packets_received;  /* count of the packets received by receiver */
+SIMLOCAL int parity_sent;       /* FEC: parity packets sent by A */
+SIMLOCAL int fec_recovered;     /* FEC: packets B rebuilt from parity */
+SIMLOCAL int naks_sent;         /* NAK packets sent by B */
+SIMLOCAL int gaps_filled;       /* holes in B's window that were filled, */
+SIMLOCAL double gap_time;       /* and the time from seeing each to filling it */
+
+/* current state kept up to date by the protocols, summed over flows */
+SIMLOCAL int window_occupancy;   /* packets sent by A and not yet ACKed */
+SIMLOCAL int receiver_buffered;  /* out of order packets held by B */
 
 /* statistics updated by emulator */
 static int packets_lost;  
 static int packets_corrupt;
 static int packets_sent;
 static int packets_timeout;
-static int messages_delivered;
+static SIMLOCAL int messages_delivered;
 
-static int nsim = 0;              /* number of messages from 5 to 4 so far */ 
-static int nsimmax = 0;           /* number of msgs to generate, then stop */
-static float time = 0.000;
+static SIMLOCAL int nsim = 0;     /* number of messages from 5 to 4 so far */ 
+static int nsimmax = 0;           /* number of msgs per flow to generate, then stop */
+static SIMLOCAL simtime_t now = 0;  /* current time, in ticks */
 static float lossprob;            /* probability that a packet is dropped  */
 static float corruptprob;   /* probability that one bit is packet is flipped */
 static int corruptdirection; /* A->B A<-B or bidirectional corruption/loss */
 static float lambda;        /* arrival rate of messages from layer 5 */   
 static int   ntolayer3;           /* number sent into layer 3 */
+static int   nsentby[2];          /* number sent into layer 3 by A and by B */
 static int   nlost;               /* number lost in media */
 static int ncorrupt;              /* number corrupted by media*/
+static SIMLOCAL int inflight[2]; /* packets in the medium on their way to A and to B */
+static SIMLOCAL long nevents_done; /* number of events simulated */
+static uint64_t chanrng[2];       /* PDES: random stream of each direction */
+#if PAIRED > 0
+static uint64_t txrng;            /* random stream of the packet sent */
+#endif
+static int runseed = 9999;
 
 /****************************************************************************/
 /* jimsrand(): return a double in range [0,1].  The routine below is used to */
@@ -100,85 +242,1230 @@ double jimsrand(void)
   return(x);
 }  
 
+/* PDES builds give the channel and the message arrivals random streams of
+   their own (splitmix64), so that the numbers they draw do not depend on
+   the order in which the partitions get to them.  PAIRED builds go further
+   and give each packet sent a stream of its own, see PAIRED COMPARISON */
+static uint64_t mix64(uint64_t z)
+{
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static uint64_t streamseed(int stream)
+{
+  return mix64(((uint64_t)runseed << 32 | stream) * 0x9e3779b97f4a7c15ULL);
+}
+
+double streamrand(uint64_t *state)
+{
+  uint64_t z = mix64(*state += 0x9e3779b97f4a7c15ULL);
+
+  return (z >> 11) * (1.0 / 9007199254740992.0);  /* 53 bits in [0,1) */
+}
+
+#if PAIRED > 0
+#define FLOWRAND(flow)   streamrand(&flows[flow].rng)
+#define CHANRAND(from)   ((void)(from), streamrand(&txrng))  /* keyed per packet */
+#elif PDES
+#define FLOWRAND(flow)   streamrand(&flows[flow].rng)
+#define CHANRAND(from)   streamrand(&chanrng[from])
+#else
+#define FLOWRAND(flow)   ((void)(flow), jimsrand())  /* one stream for all flows */
+#define CHANRAND(from)   ((void)(from), jimsrand())
+#endif
+
+/********************* PROFILING *********************/
+/* Build with -DPROFILE=1 to count the cycles spent in each kind of event,
+   in each protocol handler and in the event list and timer operations.
+   Times are inclusive: a handler's cycles include the insertevent and
+   timer calls it makes.  Each sample goes into a log2 histogram, and a
+   table with the totals and percentiles is printed at the end of the run.
+   When PROFILE is 0 the macros below are empty. */
+#ifndef PROFILE
+#define PROFILE 0
+#endif
+
+#if PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define cycles() __rdtsc()
+#else
+#include <time.h>
+static uint64_t cycles(void)     /* nanoseconds where there is no TSC */
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+#endif
+
+enum profslot {
+  PROF_FROMLAYER5, PROF_FROMLAYER3, PROF_TIMER,
+  PROF_A_OUTPUT, PROF_B_OUTPUT, PROF_A_INPUT, PROF_B_INPUT,
+  PROF_A_TIMER, PROF_B_TIMER,
+  PROF_INSERT, PROF_POP, PROF_STOPTIMER, PROF_STARTTIMER,
+  NPROF
+};
+
+static const char *profnames[NPROF] = {
+  "event: from layer 5", "event: from layer 3", "event: timer interrupt",
+  "A_output", "B_output", "A_input", "B_input",
+  "A_timerinterrupt", "B_timerinterrupt",
+  "insertevent", "event list pop", "stoptimer", "starttimer"
+};
+
+#define PROFBUCKETS 48    /* bucket b holds samples of [2^(b-1), 2^b) cycles */
+
+static struct {
+  unsigned long calls;
+  uint64_t total, max;
+  unsigned long hist[PROFBUCKETS];
+} prof[NPROF];
+static uint64_t profloop;  /* cycles in the whole event loop */
+
+static void profrecord(int slot, uint64_t c)
+{
+  int b = 0;
+
+  prof[slot].calls++;
+  prof[slot].total += c;
+  if (c > prof[slot].max)
+    prof[slot].max = c;
+  while (c != 0 && b < PROFBUCKETS-1) {
+    c >>= 1;
+    b++;
+  }
+  prof[slot].hist[b]++;
+}
+
+/* upper bound of the bucket holding the q-th quantile of slot */
+static uint64_t profquantile(int slot, double q)
+{
+  unsigned long want = (unsigned long)(q * prof[slot].calls), seen = 0;
+  int b;
+
+  for (b=0; b<PROFBUCKETS-1; b++) {
+    seen += prof[slot].hist[b];
+    if (seen > want)
+      break;
+  }
+  return b ? ((uint64_t)1 << b) - 1 : 0;
+}
+
+static void printprofile(void)
+{
+  int i;
+
+  printf("\nprofile (cycles, inclusive; percentiles are log2 bucket bounds)\n");
+  printf("%-24s %10s %14s %6s %9s %9s %9s %11s\n",
+         "", "calls", "total", "%loop", "mean", "p50<=", "p99<=", "max");
+  for (i=0; i<NPROF; i++) {
+    if (prof[i].calls == 0)
+      continue;
+    printf("%-24s %10lu %14llu %6.2f %9.1f %9llu %9llu %11llu\n",
+           profnames[i], prof[i].calls, (unsigned long long)prof[i].total,
+           profloop ? 100.0 * prof[i].total / profloop : 0.0,
+           (double)prof[i].total / prof[i].calls,
+           (unsigned long long)profquantile(i, 0.5),
+           (unsigned long long)profquantile(i, 0.99),
+           (unsigned long long)prof[i].max);
+  }
+  printf("%-24s %10s %14llu\n", "event loop", "", (unsigned long long)profloop);
+}
+
+#define PROF_BEGIN(v)     uint64_t v = cycles()
+#define PROF_END(slot, v) profrecord(slot, cycles() - (v))
+#else
+#define PROF_BEGIN(v)
+#define PROF_END(slot, v)
+#endif
+
 /********************* EVENT HANDLINE ROUTINES *******/
 /*  The next set of routines handle the event list   */
 /*****************************************************/
 
+/* true if event p must be simulated before event q.  Events at the same
+   time are taken most recently scheduled first, as the sorted list did.
+   Partitions have no common order of scheduling, so PDES breaks the tie on
+   the event itself: no two pending events agree on flow, entity and type
+   as well as time */
+static int evbefore(struct event *p, struct event *q)
+{
+  if (p->evtime != q->evtime)
+    return (p->evtime < q->evtime);
+#if PDES
+  if (p->evflow != q->evflow)
+    return (p->evflow < q->evflow);
+  if (p->eventity != q->eventity)
+    return (p->eventity < q->eventity);
+  return (p->evtype < q->evtype);
+#else
+  return (p->evseq > q->evseq);
+#endif
+}
+
+static void evplace(struct event *p, int i)
+{
+  evheap[i] = p;
+  p->evslot = i;
+}
+
+static void siftup(int i)
+{
+  struct event *p = evheap[i];
+  int parent;
+
+  while (i > 0) {
+    parent = (i-1)/2;
+    if (!evbefore(p, evheap[parent]))
+      break;
+    evplace(evheap[parent], i);
+    i = parent;
+  }
+  evplace(p, i);
+}
+
+static void siftdown(int i)
+{
+  struct event *p = evheap[i];
+  int child;
+
+  while ((child = 2*i+1) < nevents) {
+    if (child+1 < nevents && evbefore(evheap[child+1], evheap[child]))
+      child++;
+    if (!evbefore(evheap[child], p))
+      break;
+    evplace(evheap[child], i);
+    i = child;
+  }
+  evplace(p, i);
+}
+
 void insertevent(struct event *p)
 {
-  struct event *q,*qold;
+  PROF_BEGIN(prof0);
 
   if (TRACE>2) {
-    printf("            INSERTEVENT: time is %f\n",time);
-    printf("            INSERTEVENT: future time will be %f\n",p->evtime); 
+    printf("            INSERTEVENT: time is %f\n",TICKS_TO_UNITS(now));
+    printf("            INSERTEVENT: future time will be %f\n",TICKS_TO_UNITS(p->evtime)); 
   }
-  q = evlist;     /* q points to front of list in which p struct inserted */
-  if (q==NULL) {   /* list is empty */
-    evlist=p;
-    p->next=NULL;
-    p->prev=NULL;
+  if (nevents == evheapsize) {
+    evheapsize = evheapsize ? 2*evheapsize : 64;
+    evheap = realloc(evheap, evheapsize * sizeof(struct event *));
+    if (evheap == 0) {
+      printf("memory allocation for event list failed.");
+      exit(EXIT_FAILURE);
+    }
   }
-  else {
-    for (qold = q; q !=NULL && p->evtime > q->evtime; q=q->next)
-      qold=q; 
-    if (q==NULL) {   /* end of list */
-      qold->next = p;
-      p->prev = qold;
-      p->next = NULL;
+  p->evseq = nextevseq++;
+  evplace(p, nevents++);
+  siftup(p->evslot);
+  PROF_END(PROF_INSERT, prof0);
+}
+
+/* take event p off the event list */
+void removeevent(struct event *p)
+{
+  int i = p->evslot;
+
+  nevents--;
+  if (i == nevents)
+    return;
+  evplace(evheap[nevents], i);
+  if (i > 0 && evbefore(evheap[i], evheap[(i-1)/2]))
+    siftup(i);
+  else
+    siftdown(i);
+}
+
+/* put a new event on the event list of the partition that owns it.  Other
+   than during a parallel window that is done through the owner's inbox */
+static void schedule(struct event *p)
+{
+  struct partition *q;
+
+  if (nparts == 1 || inwindow) {
+    insertevent(p);
+    return;
+  }
+  q = &parts[OWNER(p->evflow, p->eventity)];
+  if (q->nin == q->insize) {
+    q->insize = q->insize ? 2*q->insize : 64;
+    q->in = realloc(q->in, q->insize * sizeof(struct event *));
+    if (q->in == 0) {
+      printf("memory allocation for inbox failed.");
+      exit(EXIT_FAILURE);
     }
-    else if (q==evlist) { /* front of list */
-      p->next=evlist;
-      p->prev=NULL;
-      p->next->prev=p;
-      evlist = p;
+  }
+  q->in[q->nin++] = p;
+  if (p->evtime < q->next)
+    q->next = p->evtime;
+}
+
+/********************* WORKLOADS *********************/
+/* How the messages of each flow arrive from layer 5, chosen in init():
+   UNIFORM     gaps uniform on [0, 2*lambda], as in the original emulator
+   SATURATING  A always has a message waiting: it is offered again each
+               time A hears from the network until the window takes it,
+               and refusals do not count as drops.  Gives the throughput
+               the protocol can carry at most.  Timeouts can then put
+               resends into the channel faster than it drains them, so
+               the run stops at a time limit asked for in init(), and the
+               offered and carried loads are over that time
+   POISSON     gaps exponential with mean lambda
+   ONOFF       Poisson arrivals in bursts, with exponentially distributed
+               lengths of the bursts and of the silences between them
+   TRACEFILE   arrival times read from a file, one per line as
+               "time [flow]" (flow 0 if left out); '#' starts a comment */
+#define UNIFORM     0
+#define SATURATING  1
+#define POISSON     2
+#define ONOFF       3
+#define TRACEFILE   4
+
+static int workload = UNIFORM;
+static float onmean, offmean;    /* ONOFF: mean lengths of bursts and silences */
+static simtime_t stopat = NEVER; /* SATURATING: the time limit */
+static int timeup;               /* the run reached the time limit */
+
+/* natural logarithm of x > 0, here so that the default build needs no -lm */
+static double loge(double x)
+{
+  double y, y2, term, sum = 0.0;
+  int i, k = 0;
+
+  while (x > 2.0) {
+    x /= 2.0;
+    k++;
+  }
+  while (x < 1.0) {
+    x *= 2.0;
+    k--;
+  }
+  y = (x - 1.0) / (x + 1.0);     /* ln x = 2 atanh y, and |y| <= 1/3 */
+  y2 = y * y;
+  term = y;
+  for (i = 1; i < 40; i += 2) {
+    sum += term / i;
+    term *= y2;
+  }
+  return 2.0 * sum + k * 0.69314718055994530942;
+}
+
+/* an exponentially distributed time, in ticks, with the given mean */
+static simtime_t expgap(double mean, int flow)
+{
+  double u = FLOWRAND(flow);
+
+  if (u >= 1.0)                  /* jimsrand() can return 1 */
+    u = 0.999999;
+  return UNITS_TO_TICKS(-mean * loge(1.0 - u));
+}
+
+void readtrace(const char *name)
+{
+  FILE *fp;
+  char line[128];
+  double t;
+  int f;
+  struct flow *fl;
+
+  fp = fopen(name, "r");
+  if (fp == NULL) {
+    printf("cannot open trace file %s\n", name);
+    exit(EXIT_FAILURE);
+  }
+  while (fgets(line, sizeof line, fp) != NULL) {
+    f = 0;
+    if (line[0] == '#' || sscanf(line, "%lf %d", &t, &f) < 1)
+      continue;
+    if (f < 0 || f >= nflows)
+      continue;                  /* a flow that is not simulated */
+    fl = &flows[f];
+    if (fl->ntrace == fl->tracesize) {
+      fl->tracesize = fl->tracesize ? 2 * fl->tracesize : 256;
+      fl->trace = realloc(fl->trace, fl->tracesize * sizeof(simtime_t));
+      if (fl->trace == 0) {
+        printf("memory allocation for trace failed.");
+        exit(EXIT_FAILURE);
+      }
     }
-    else {     /* middle of list */
-      p->next=q;
-      p->prev=q->prev;
-      q->prev->next=p;
-      q->prev=p;
+    if (fl->ntrace > 0 && UNITS_TO_TICKS(t) < fl->trace[fl->ntrace-1]) {
+      printf("trace file %s: arrival times of flow %d go backwards at %f\n", name, f, t);
+      exit(EXIT_FAILURE);
     }
+    fl->trace[fl->ntrace++] = UNITS_TO_TICKS(t);
   }
+  fclose(fp);
 }
 
-void generate_next_arrival(void)
+void generate_next_arrival(int flow)
 {
-  double x;
+  struct flow *fl = &flows[flow];
   struct event *evptr;
+  simtime_t at, start;
 
   if (TRACE>2)
     printf("          GENERATE NEXT ARRIVAL: creating new arrival\n");
  
-  x = lambda*jimsrand()*2;  /* x is uniform on [0,2*lambda] */
-  /* having mean of lambda        */
+  switch (workload) {
+  case SATURATING:               /* the first offer; A_input asks for more */
+    at = now;
+    break;
+  case POISSON:
+    at = now + expgap(lambda, flow);
+    break;
+  case ONOFF:
+    at = now + expgap(lambda, flow);
+    while (at > fl->onuntil) {   /* the burst is over: skip a silence */
+      start = fl->onuntil + expgap(offmean, flow);
+      fl->onuntil = start + expgap(onmean, flow);
+      at = start + expgap(lambda, flow);
+    }
+    break;
+  case TRACEFILE:
+    if (fl->tracenext == fl->ntrace)
+      return;                    /* the trace has run out */
+    at = fl->trace[fl->tracenext++];
+    if (at < now)
+      at = now;
+    break;
+  default:
+    /* x is uniform on [0,2*lambda], having mean of lambda */
+    at = now + UNITS_TO_TICKS(lambda*FLOWRAND(flow)*2);
+    break;
+  }
   evptr = malloc(sizeof(struct event));
   if (evptr == 0) {
     printf("memory allocation for event failed.");
     exit(EXIT_FAILURE);
   }
-  evptr->evtime =  time + x;
+  evptr->evtime =  at;
   evptr->evtype =  FROM_LAYER5;
-  if (BIDIRECTIONAL && (jimsrand()>0.5) )
+  evptr->evflow =  flow;
+  if (BIDIRECTIONAL && (FLOWRAND(flow)>0.5) )
     evptr->eventity = B;
   else
     evptr->eventity = A;
-  insertevent(evptr);
+  schedule(evptr);
 } 
 
 void printevlist(void)
 {
   struct event *q;
-  printf("--------------\nEvent List Follows:\n");
-  for(q = evlist; q!=NULL; q=q->next) {
-    printf("Event time: %f, type: %d entity: %d\n",q->evtime,q->evtype,q->eventity);
+  int i;
+  printf("--------------\nEvent List Follows (heap order):\n");
+  for(i = 0; i < nevents; i++) {
+    q = evheap[i];
+    printf("Event time: %f, type: %d entity: %d flow: %d\n",TICKS_TO_UNITS(q->evtime),q->evtype,q->eventity,q->evflow);
   }
   printf("--------------\n");
 }
 
+/********************* TIME-SERIES SAMPLER *********/
+/* Build with -DSAMPLE_INTERVAL=<time units> and/or -DSAMPLE_EVENTS=<n> to
+   record the state of the protocols and the channel every so often.
+   Samples are written to SAMPLE_FILE in blocks of up to SAMPLE_ROWS rows,
+   column by column, in the byte order of the machine:
+     header:  "SIMSMPL2", uint32 ticks per time unit, uint32 columns,
+              then every column name NUL-terminated
+     block:   uint32 rows, int64 time in ticks[rows], int64 events[rows],
+              and then int32 values[rows] for each of the other columns
+              in turn
+   The interval must be at least one tick once rounded, which
+   sampleropen() checks. */
+#ifndef SAMPLE_INTERVAL
+#define SAMPLE_INTERVAL 0
+#endif
+#ifndef SAMPLE_EVENTS
+#define SAMPLE_EVENTS 0
+#endif
+#ifndef SAMPLE_FILE
+#define SAMPLE_FILE "samples.bin"
+#endif
+#define SAMPLE_ROWS 4096
+
+static const char *samplecols[] = {
+  "time", "events", "pending", "window", "rcvbuffer", "inflight_ab",
+  "inflight_ba", "sent", "lost", "corrupt", "delivered", "resent",
+  "new_acks", "window_full"
+};
+#define NSAMPLECOLS ((int)(sizeof(samplecols) / sizeof(samplecols[0])))
+
+static FILE *samplefp = NULL;
+static simtime_t *sampletimes;      /* time column of the current block */
+static int64_t *sampleevents;       /* events column */
+static int32_t *samplevals;         /* other columns, SAMPLE_ROWS each */
+static int samplerows;              /* rows in the current block */
+static long nsamples;
+static simtime_t nextsample;
+
+void samplerflush(void)
+{
+  uint32_t rows = samplerows;
+  int c;
+
+  if (rows == 0)
+    return;
+  fwrite(&rows, sizeof(rows), 1, samplefp);
+  fwrite(sampletimes, sizeof(simtime_t), rows, samplefp);
+  fwrite(sampleevents, sizeof(int64_t), rows, samplefp);
+  for (c=0; c<NSAMPLECOLS-2; c++)
+    fwrite(samplevals + c*SAMPLE_ROWS, sizeof(int32_t), rows, samplefp);
+  samplerows = 0;
+}
+
+void takesample(simtime_t t)
+{
+  int32_t *v = samplevals + samplerows;
+
+  sampletimes[samplerows] = t;
+  sampleevents[samplerows] = nevents_done;
+  v[0*SAMPLE_ROWS] = nevents;
+  v[1*SAMPLE_ROWS] = window_occupancy;
+  v[2*SAMPLE_ROWS] = receiver_buffered;
+  v[3*SAMPLE_ROWS] = inflight[B];
+  v[4*SAMPLE_ROWS] = inflight[A];
+  v[5*SAMPLE_ROWS] = ntolayer3;
+  v[6*SAMPLE_ROWS] = nlost;
+  v[7*SAMPLE_ROWS] = ncorrupt;
+  v[8*SAMPLE_ROWS] = messages_delivered;
+  v[9*SAMPLE_ROWS] = packets_resent;
+  v[10*SAMPLE_ROWS] = new_ACKs;
+  v[11*SAMPLE_ROWS] = window_full;
+  nsamples++;
+  if (++samplerows == SAMPLE_ROWS)
+    samplerflush();
+}
+
+void sampleropen(void)
+{
+  uint32_t word;
+  int c;
+
+  if (SAMPLE_INTERVAL > 0 && UNITS_TO_TICKS(SAMPLE_INTERVAL) < 1) {
+    printf("SAMPLE_INTERVAL %g is shorter than one tick.", (double)SAMPLE_INTERVAL);
+    exit(EXIT_FAILURE);
+  }
+  samplefp = fopen(SAMPLE_FILE, "wb");
+  sampletimes = malloc(SAMPLE_ROWS * sizeof(simtime_t));
+  sampleevents = malloc(SAMPLE_ROWS * sizeof(int64_t));
+  samplevals = malloc((NSAMPLECOLS-2) * SAMPLE_ROWS * sizeof(int32_t));
+  if (samplefp == NULL || sampletimes == 0 || sampleevents == 0 || samplevals == 0) {
+    printf("unable to set up the sampler (%s).", SAMPLE_FILE);
+    exit(EXIT_FAILURE);
+  }
+  fwrite("SIMSMPL2", 1, 8, samplefp);
+  word = TICKS_PER_UNIT;
+  fwrite(&word, sizeof(word), 1, samplefp);
+  word = NSAMPLECOLS;
+  fwrite(&word, sizeof(word), 1, samplefp);
+  for (c=0; c<NSAMPLECOLS; c++)
+    fwrite(samplecols[c], 1, strlen(samplecols[c]) + 1, samplefp);
+  nextsample = 0;
+}
+
+/********************* BRANCHING ********************/
+/* Build with -DFORK=1 to share a warm-up between several variants of a
+   run.  init() then asks for the time to branch at and for the loss and
+   corruption probabilities and mean time between messages of each variant.
+   When the simulation gets to that time the process forks once for each
+   variant.  A child has a copy (on write) of all the state: event list,
+   protocol windows, counters and random number generator.  It switches to
+   its own parameters and carries on, writing to variant<n>.out, while the
+   parent carries on unchanged and collects the children at the end.  The
+   branches draw the same random numbers from then on. */
+#if FORK
+#if PDES || SAMPLE_INTERVAL > 0 || SAMPLE_EVENTS > 0
+#error "branching is not available with PDES or sampling"
+#endif
+
+struct variant {
+  float lossprob, corruptprob, lambda;
+  pid_t pid;                      /* child running it, 0 if not started */
+};
+
+static simtime_t branchat = NEVER;
+static struct variant *variants;
+static int nvariants;
+
+void branch(void)
+{
+  struct variant *v;
+  simtime_t at = branchat;
+  char name[32];
+  int i;
+
+  branchat = NEVER;
+  fflush(stdout);                 /* or the children print it again */
+  for (i=0; i<nvariants; i++) {
+    v = &variants[i];
+    v->pid = fork();
+    if (v->pid < 0) {
+      printf("unable to start variant %d.", i+1);
+      exit(EXIT_FAILURE);
+    }
+    if (v->pid == 0) {
+      nvariants = 0;
+      sprintf(name, "variant%d.out", i+1);
+      if (freopen(name, "w", stdout) == NULL)
+        exit(EXIT_FAILURE);
+      lossprob = v->lossprob;
+      corruptprob = v->corruptprob;
+      lambda = v->lambda;
+      printf("variant %d, branched at time %f: loss probability %f, corruption probability %f, average time between messages %f\n",
+             i+1, TICKS_TO_UNITS(at), lossprob, corruptprob, lambda);
+      return;
+    }
+  }
+}
+
+void waitvariants(void)
+{
+  struct variant *v;
+  int i, status;
+
+  for (i=0; i<nvariants; i++) {
+    v = &variants[i];
+    if (v->pid == 0) {
+      printf("variant %d: not started, the simulation ended before branching\n", i+1);
+      continue;
+    }
+    waitpid(v->pid, &status, 0);
+    printf("variant %d: loss probability %f, corruption probability %f, average time between messages %f: %s, see variant%d.out\n",
+           i+1, v->lossprob, v->corruptprob, v->lambda,
+           WIFEXITED(status) && WEXITSTATUS(status) == 0 ? "done" : "FAILED", i+1);
+  }
+}
+#endif
+
+#if PRECISION > 0 || PAIRED > 0
+/* two-sided 95% quantile of Student's t distribution */
+static double tquantile(int df)
+{
+  static const double t[30] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+  };
+  return df <= 30 ? t[df-1] : 1.96 + 2.37/df;
+}
+#endif
+
+/********************* SEQUENTIAL STOPPING ***********/
+/* Build with -DPRECISION=<percent> to simulate only until the 95%
+   confidence intervals of goodput, 99th percentile latency and resend
+   ratio (resends per packet sent by A) are within that many percent of
+   their means, taking at least MINSAMPLES observations.
+   With -DBATCHSIZE=<n> the observations are batch means within the run:
+   every n deliveries make a batch, the first batch is dropped as warm-up,
+   and the run ends as soon as the intervals are narrow enough.  Batches
+   have to be long enough to be close to independent, so the lag-1
+   autocorrelation of their goodputs is printed as a check.
+   Without BATCHSIZE whole runs are replicated instead, each in a child
+   process with its own seed, up to MAXREPS of them.
+   Each observation of a metric is a ratio x/w (messages over time, resends
+   over packets sent, and the p99 over 1), and the estimate is the ratio of
+   the totals with the usual ratio estimator interval.  The mean of the
+   ratios would weigh a batch that ends quickly, as after a burst of
+   deliveries, as much as a long one and miss the true goodput.  Link with
+   -lm. */
+#if PRECISION > 0
+#define MINSAMPLES 10
+#define MAXREPS 1000
+#define NMETRICS 3
+
+#if PDES || (FORK && BATCHSIZE == 0)
+#error "sequential stopping works with the sequential emulator, and with branching only in batch means"
+#endif
+
+static const char *metricnames[NMETRICS] = {
+  "goodput", "latency p99", "resend ratio"
+};
+static double sx[NMETRICS], sw[NMETRICS];   /* sums of the observations x/w */
+static double sxx[NMETRICS], sxw[NMETRICS], sww[NMETRICS];
+static int nobs;                 /* batches or replications so far */
+static double firstobs, lastobs, lagsum, rsum, rsumsq; /* batch goodputs, for the autocorrelation */
+static simtime_t *lats;          /* latencies of the batch or replication */
+static int nlats, latsize;
+static int nbatches;             /* batches so far, warm-up included */
+static simtime_t batchstart;
+static int batchsent, batchresent;
+static int stopnow;              /* the intervals are narrow enough */
+
+static double estimate(int m)
+{
+  return sw[m] > 0 ? sx[m] / sw[m] : 0.0;
+}
+
+static double halfwidth(int m)
+{
+  double r = estimate(m);
+  double ss = sxx[m] - 2*r*sxw[m] + r*r*sww[m];  /* sum of (x - r*w)^2 */
+  double wbar = sw[m] / nobs;
+
+  if (ss <= 0 || wbar <= 0)
+    return 0.0;
+  return tquantile(nobs - 1) * sqrt(ss / (nobs * (nobs - 1.0))) / wbar;
+}
+
+static int converged(void)
+{
+  int m;
+
+  if (nobs < MINSAMPLES)
+    return 0;
+  for (m=0; m<NMETRICS; m++)
+    if (halfwidth(m) > PRECISION / 100.0 * fabs(estimate(m)))
+      return 0;
+  return 1;
+}
+
+static void addobservation(const double x[NMETRICS], const double w[NMETRICS])
+{
+  double rate = w[0] > 0 ? x[0] / w[0] : 0.0;
+  int m;
+
+  for (m=0; m<NMETRICS; m++) {
+    sx[m] += x[m];
+    sw[m] += w[m];
+    sxx[m] += x[m] * x[m];
+    sxw[m] += x[m] * w[m];
+    sww[m] += w[m] * w[m];
+  }
+  if (nobs == 0)
+    firstobs = rate;
+  else
+    lagsum += lastobs * rate;
+  lastobs = rate;
+  rsum += rate;
+  rsumsq += rate * rate;
+  nobs++;
+}
+
+/* the q-th quantile of v[0..n-1], which is reordered */
+static simtime_t quantile(simtime_t *v, int n, double q)
+{
+  int k = (int)ceil(q * n) - 1, lo = 0, hi = n - 1, i, j;
+  simtime_t pivot, tmp;
+
+  if (k < 0)
+    k = 0;
+  while (lo < hi) {             /* Hoare's selection */
+    pivot = v[(lo + hi) / 2];
+    i = lo;
+    j = hi;
+    while (i <= j) {
+      while (v[i] < pivot)
+        i++;
+      while (v[j] > pivot)
+        j--;
+      if (i <= j) {
+        tmp = v[i];
+        v[i++] = v[j];
+        v[j--] = tmp;
+      }
+    }
+    if (k <= j)
+      hi = j;
+    else if (k >= i)
+      lo = i;
+    else
+      break;
+  }
+  return v[k];
+}
+
+/* the metrics since batchstart, as ratios x/w */
+static void measure(double x[NMETRICS], double w[NMETRICS], int delivered)
+{
+  x[0] = delivered;
+  w[0] = TICKS_TO_UNITS(now - batchstart);
+  x[1] = nlats > 0 ? TICKS_TO_UNITS(quantile(lats, nlats, 0.99)) : 0.0;
+  w[1] = 1.0;
+  x[2] = packets_resent - batchresent;
+  w[2] = nsentby[A] - batchsent;
+}
+
+/* called for every message delivered at B */
+void recordlatency(simtime_t latency)
+{
+  double x[NMETRICS], w[NMETRICS];
+
+  if (nlats == latsize) {
+    latsize = latsize ? 2*latsize : (BATCHSIZE > 0 ? BATCHSIZE : 1024);
+    lats = realloc(lats, latsize * sizeof(simtime_t));
+    if (lats == 0) {
+      printf("memory allocation for latencies failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  lats[nlats++] = latency;
+  if (BATCHSIZE == 0 || nlats < BATCHSIZE)
+    return;
+  measure(x, w, nlats);
+  batchstart = now;
+  batchsent = nsentby[A];
+  batchresent = packets_resent;
+  nlats = 0;
+  if (nbatches++ == 0)
+    return;                     /* warm-up */
+  addobservation(x, w);
+  if (converged())
+    stopnow = 1;
+}
+
+void printintervals(void)
+{
+  double mean, r1 = 0.0, ss;
+  int m;
+
+  if (nobs < 2) {
+    printf("sequential stopping: too few %s for confidence intervals\n",
+           BATCHSIZE > 0 ? "batches" : "replications");
+    return;
+  }
+  if (BATCHSIZE > 0)
+    printf("sequential stopping: %d batches of %d deliveries after warm-up, ",
+           nobs, BATCHSIZE);
+  else
+    printf("sequential stopping: %d replications, ", nobs);
+  printf("target precision %d%% %s\n", PRECISION,
+         converged() ? "reached" : "NOT reached");
+  for (m=0; m<NMETRICS; m++) {
+    mean = estimate(m);
+    printf("  %-14s %f +- %f (95%% confidence, %.1f%%)\n", metricnames[m],
+           mean, halfwidth(m), mean != 0.0 ? 100.0 * halfwidth(m) / fabs(mean) : 0.0);
+  }
+  if (BATCHSIZE > 0) {
+    mean = rsum / nobs;
+    ss = rsumsq - nobs*mean*mean;
+    if (ss > 0)
+      r1 = (lagsum - mean*(2*rsum - firstobs - lastobs) + (nobs-1)*mean*mean) / ss;
+    printf("  lag-1 autocorrelation of batch goodputs %f%s\n", r1,
+           r1 > 0.2 ? ", use larger batches" : "");
+  }
+}
+
+#if BATCHSIZE == 0
+static int repfd = -1;           /* replication: pipe to the parent */
+
+/* run replications in child processes until the intervals are narrow
+   enough; only the children return */
+void replicate(void)
+{
+  double obs[2][NMETRICS];      /* x and w of each metric */
+  int fd[2], k, status;
+  ssize_t got;
+  pid_t pid;
+
+  for (k=0; k<MAXREPS && !converged(); k++) {
+    fflush(stdout);
+    if (pipe(fd) < 0 || (pid = fork()) < 0) {
+      printf("unable to start replication %d.", k+1);
+      exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+      close(fd[0]);
+      repfd = fd[1];
+      srand(9999 + k);
+      if (freopen("/dev/null", "w", stdout) == NULL)
+        exit(EXIT_FAILURE);
+      return;
+    }
+    close(fd[1]);
+    got = read(fd[0], obs, sizeof(obs));
+    close(fd[0]);
+    waitpid(pid, &status, 0);
+    if (got != sizeof(obs) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      printf("replication %d failed.\n", k+1);
+      exit(EXIT_FAILURE);
+    }
+    printf("replication %d: goodput %f, latency p99 %f, resend ratio %f\n",
+           k+1, obs[0][0] / obs[1][0], obs[0][1], obs[0][2] / obs[1][2]);
+    addobservation(obs[0], obs[1]);
+  }
+  printintervals();
+  exit(EXIT_SUCCESS);
+}
+
+/* a replication sends its metrics to the parent */
+void reportreplication(void)
+{
+  double obs[2][NMETRICS];
+
+  measure(obs[0], obs[1], messages_delivered);
+  if (write(repfd, obs, sizeof(obs)) != sizeof(obs))
+    exit(EXIT_FAILURE);
+}
+#endif
+#endif
+
+/********************* PAIRED COMPARISON *************/
+/* Build with -DPAIRED=<n> to compare protocols on common random numbers.
+   The run is replicated n times, each in a child process with a seed of
+   its own, and the random numbers are keyed on what they are for and not
+   on the order in which they are drawn.  The arrivals of each flow come
+   from a stream of the flow, and every packet sent gets a stream of its
+   own for its loss, delay and corruption.  For A's data the stream is
+   keyed by the flow, the message (told apart by its letter) and how many
+   times the message has been sent; for other packets, parity packets
+   included, by the flow, the sender and how many of them it has sent.
+   So the k-th transmission of a message meets the same channel in the
+   gbn and sr builds.
+   The goodput, mean latency and resend ratio of each replication are
+   saved in a file, and given the file of the other protocol the run
+   prints the paired differences with their 95% confidence intervals, and
+   how many times as many replications independent runs would need for the
+   same interval.  Link with -lm. */
+#if PAIRED > 0
+#if PRECISION > 0 || FORK
+#error "sequential stopping and branching cannot be combined with a paired comparison"
+#endif
+#ifdef TOPOLOGY
+#error "a paired comparison needs the direct channel"
+#endif
+#define NPAIRED 3
+
+static const char *pairednames[NPAIRED] = {
+  "goodput", "mean latency", "resend ratio"
+};
+static double pairedobs[PAIRED][NPAIRED];
+static char pairedfile[256], pairedwith[256];
+static int pairedfd = -1;        /* replication: pipe to the parent */
+
+/* set txrng for a packet that A or B is about to send */
+static void keytransmission(int AorB, struct pkt *packet)
+{
+  struct flow *fl = &flows[curflow];
+  int c = packet->payload[0] - 'a';
+  uint64_t key;
+
+  if (AorB == A && packet->acknum > PARITY(1) &&
+      c >= 0 && c < 26 && packet->payload[19] == packet->payload[0])
+    key = ((uint64_t)fl->lastid[c] << 24 | fl->sends[c]++) << 2;
+  else
+    key = (uint64_t)fl->others[AorB]++ << 2 | 2 | AorB;
+  txrng = mix64(streamseed(2 + curflow) ^ mix64(key));
+}
+
+/* this run minus the one saved in file name, replication by replication */
+static void comparepaired(const char *name)
+{
+  FILE *fp;
+  char line[256];
+  double y[PAIRED][NPAIRED], d, md, mx, my, sd, sx, sy, hw;
+  int k, m, n = 0;
+
+  fp = fopen(name, "r");
+  if (fp == NULL) {
+    printf("cannot open %s\n", name);
+    exit(EXIT_FAILURE);
+  }
+  while (n < PAIRED && fgets(line, sizeof line, fp) != NULL)
+    if (line[0] != '#' &&
+        sscanf(line, "%*d %lf %lf %lf", &y[n][0], &y[n][1], &y[n][2]) == NPAIRED)
+      n++;
+  fclose(fp);
+  if (n < 2) {
+    printf("paired comparison: too few replications in %s\n", name);
+    return;
+  }
+  printf("paired comparison over %d replications, this run minus %s:\n", n, name);
+  for (m=0; m<NPAIRED; m++) {
+    md = mx = my = 0.0;
+    for (k=0; k<n; k++) {
+      md += pairedobs[k][m] - y[k][m];
+      mx += pairedobs[k][m];
+      my += y[k][m];
+    }
+    md /= n;
+    mx /= n;
+    my /= n;
+    sd = sx = sy = 0.0;
+    for (k=0; k<n; k++) {
+      d = pairedobs[k][m] - y[k][m] - md;
+      sd += d * d;
+      sx += (pairedobs[k][m] - mx) * (pairedobs[k][m] - mx);
+      sy += (y[k][m] - my) * (y[k][m] - my);
+    }
+    sd /= n - 1;                 /* variance of the differences */
+    sx /= n - 1;
+    sy /= n - 1;
+    hw = tquantile(n - 1) * sqrt(sd / n);
+    printf("  %-14s %f +- %f (95%% confidence), variance %g paired, %g unpaired",
+           pairednames[m], md, hw, sd, sx + sy);
+    if (sd > 0)
+      printf(", %.1f times the replications without pairing", (sx + sy) / sd);
+    printf("\n");
+  }
+}
+
+/* run the replications in child processes, save their results and compare
+   them with the other protocol's; only the children return */
+void pairreplicate(void)
+{
+  FILE *fp;
+  int fd[2], k, status;
+  ssize_t got;
+  pid_t pid;
+
+  for (k=0; k<PAIRED; k++) {
+    fflush(stdout);
+    if (pipe(fd) < 0 || (pid = fork()) < 0) {
+      printf("unable to start replication %d.", k+1);
+      exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+      close(fd[0]);
+      pairedfd = fd[1];
+      runseed = 9999 + k;
+      if (freopen("/dev/null", "w", stdout) == NULL)
+        exit(EXIT_FAILURE);
+      return;
+    }
+    close(fd[1]);
+    got = read(fd[0], pairedobs[k], sizeof(pairedobs[k]));
+    close(fd[0]);
+    waitpid(pid, &status, 0);
+    if (got != sizeof(pairedobs[k]) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      printf("replication %d failed.\n", k+1);
+      exit(EXIT_FAILURE);
+    }
+    printf("replication %d: goodput %f, mean latency %f, resend ratio %f\n",
+           k+1, pairedobs[k][0], pairedobs[k][1], pairedobs[k][2]);
+  }
+  if (pairedfile[0] != '\0') {
+    fp = fopen(pairedfile, "w");
+    if (fp == NULL) {
+      printf("cannot open %s\n", pairedfile);
+      exit(EXIT_FAILURE);
+    }
+    fprintf(fp, "# replication, goodput, mean latency, resend ratio\n");
+    for (k=0; k<PAIRED; k++)
+      fprintf(fp, "%d %.17g %.17g %.17g\n", k+1,
+              pairedobs[k][0], pairedobs[k][1], pairedobs[k][2]);
+    fclose(fp);
+  }
+  if (pairedwith[0] != '\0' && strcmp(pairedwith, "-") != 0)
+    comparepaired(pairedwith);
+  exit(EXIT_SUCCESS);
+}
+
+/* a replication sends its results to the parent */
+void reportpaired(void)
+{
+  double x[NPAIRED];
+  simtime_t latsum = 0;
+  int i;
+
+  for (i=0; i<nflows; i++)
+    latsum += flows[i].latsum;
+  x[0] = now > 0 ? messages_delivered / TICKS_TO_UNITS(now) : 0.0;
+  x[1] = messages_delivered > 0 ? TICKS_TO_UNITS(latsum) / messages_delivered : 0.0;
+  x[2] = nsentby[A] > 0 ? (double)packets_resent / nsentby[A] : 0.0;
+  if (write(pairedfd, x, sizeof(x)) != sizeof(x))
+    exit(EXIT_FAILURE);
+}
+#endif
+
+/* corrupt a packet sent by entity from */
+static void corrupt(struct pkt *p, int from)
+{
+  float x;
+
+  ncorrupt++;
+  if ( (x = CHANRAND(from)) < .75)
+    p->payload[0]='Z';   /* corrupt payload */
+  else if (x < .875)
+    p->seqnum = 999999;
+  else
+    p->acknum = 999999;
+  if (TRACE>0)    
+    printf("          TOLAYER3: packet being corrupted\n");
+}
+
+/********************* TOPOLOGY **********************/
+/* Build with -DTOPOLOGY='"path.txt"' to send the packets over a chain of
+   hops with store-and-forward routers between them in place of the single
+   channel.  The file has a line per hop, from A to B:
+     min delay, max delay, loss probability, corruption probability,
+     queue limit in packets (0 for none), rate in packets per time unit
+     (0 for no transmission time)
+   and '#' starts a comment; "1 10 0.2 0.1 0 0" alone is the channel of
+   testcase.txt and topology.txt is a path of three hops.  Each hop has a
+   link in each direction, which sends its packets one after the other, so
+   a packet waits for those ahead of it and is dropped if the queue is full.
+   As on the direct channel the delay is counted from the later of its
+   departure and the previous packet's arrival, so a link never reorders.
+   The loss and corruption prompts are not used, the direction of loss and
+   corruption is, and it is always asked for.
+   A packet costs one event per hop: the queue is never stored, as with a
+   fixed transmission time its length follows from when the link is next
+   free. */
+#ifdef TOPOLOGY
+#if PDES
+#error "topologies are not available in the parallel emulator"
+#endif
+
+struct link {
+  simtime_t free;                /* when the last packet queued has gone */
+  simtime_t last;                /* latest arrival at the far end */
+  int sent, lost, dropped, corrupted, maxqueue;
+  simtime_t busy;                /* time spent sending */
+  simtime_t waited;              /* time packets spent queued */
+};
+
+struct hop {
+  double mindelay, maxdelay;
+  float lossprob, corruptprob;
+  int qlimit;
+  simtime_t txtime;              /* time to send one packet */
+  struct link link[2];           /* towards A and towards B */
+};
+
+static struct hop *hops;
+static int nhops;
+
+void readtopology(const char *name)
+{
+  FILE *fp;
+  char line[256];
+  double mindelay, maxdelay, rate;
+  float loss, corrupt;
+  int qlimit, n, size = 0;
+
+  fp = fopen(name, "r");
+  if (fp == NULL) {
+    printf("cannot open topology file %s\n", name);
+    exit(EXIT_FAILURE);
+  }
+  while (fgets(line, sizeof line, fp) != NULL) {
+    n = sscanf(line, "%lf %lf %f %f %d %lf", &mindelay, &maxdelay, &loss, &corrupt, &qlimit, &rate);
+    if (n <= 0 || line[strspn(line, " \t")] == '#')
+      continue;
+    if (n != 6 || mindelay < 0 || maxdelay < mindelay || qlimit < 0 || rate < 0) {
+      printf("topology file %s: bad hop: %s", name, line);
+      exit(EXIT_FAILURE);
+    }
+    if (nhops == size) {
+      size = size ? 2*size : 8;
+      hops = realloc(hops, size * sizeof(struct hop));
+      if (hops == 0) {
+        printf("memory allocation for hops failed.");
+        exit(EXIT_FAILURE);
+      }
+    }
+    memset(&hops[nhops], 0, sizeof(struct hop));
+    hops[nhops].mindelay = mindelay;
+    hops[nhops].maxdelay = maxdelay;
+    hops[nhops].lossprob = loss;
+    hops[nhops].corruptprob = corrupt;
+    hops[nhops].qlimit = qlimit;
+    hops[nhops].txtime = rate > 0 ? UNITS_TO_TICKS(1.0 / rate) : 0;
+    nhops++;
+  }
+  fclose(fp);
+  if (nhops == 0) {
+    printf("topology file %s has no hops\n", name);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* put packet p, which is on its way to entity to, on hop h.  The packet
+   is freed if it does not get across */
+static void sendhop(int h, int to, struct pkt *p)
+{
+  struct hop *hp = &hops[h];
+  struct link *l = &hp->link[to];
+  struct event *evptr;
+  simtime_t depart;
+  int from = (to+1) % 2, queued, next;
+  int impaired = !(from == B && corruptdirection == A) && !(from == A && corruptdirection == B);
+
+  queued = 0;                    /* packets queued or being sent */
+  if (l->free > now && hp->txtime > 0)
+    queued = (l->free - now + hp->txtime - 1) / hp->txtime;
+  if (hp->qlimit > 0 && queued >= hp->qlimit) {
+    l->dropped++;
+    nlost++;
+    if (TRACE>0)
+      printf("          HOP %d: queue full, packet dropped\n", h+1);
+    free(p);
+    return;
+  }
+  depart = (l->free > now ? l->free : now) + hp->txtime;
+  l->waited += depart - hp->txtime - now;
+  l->busy += hp->txtime;
+  l->free = depart;
+  l->sent++;
+  if (queued + 1 > l->maxqueue)
+    l->maxqueue = queued + 1;
+
+  if (CHANRAND(from) < hp->lossprob && impaired) {
+    l->lost++;
+    nlost++;
+    if (TRACE>0)
+      printf("          HOP %d: packet being lost\n", h+1);
+    free(p);
+    return;
+  }
+
+  evptr = malloc(sizeof(struct event));
+  if (evptr == 0) {
+    printf("memory allocation for event failed.");
+    exit(EXIT_FAILURE);
+  }
+  next = to == B ? h+1 : h-1;
+  if (next < 0 || next == nhops)
+    evptr->evtype = FROM_LAYER3;  /* the last hop */
+  else
+    evptr->evtype = FROM_HOP;
+  evptr->evhop = next;
+  evptr->eventity = to;
+  evptr->evflow = curflow;
+  evptr->pktptr = p;
+  if (l->last > depart)
+    depart = l->last;
+  evptr->evtime = depart + UNITS_TO_TICKS(hp->mindelay + (hp->maxdelay - hp->mindelay)*CHANRAND(from));
+  l->last = evptr->evtime;
+  inflight[to]++;
+
+  if (CHANRAND(from) < hp->corruptprob && impaired) {
+    l->corrupted++;
+    corrupt(p, from);
+  }
+  schedule(evptr);
+}
+
+void printhops(void)
+{
+  struct link *l;
+  int h, to;
+
+  for (h=0; h<nhops; h++)
+    for (to=B; to>=A; to--) {
+      l = &hops[h].link[to];
+      printf("hop %d %s: sent %d, lost %d, queue drops %d, corrupted %d, mean queueing %f, max queue %d, utilization %f \n",
+             h+1, to == B ? "A->B" : "A<-B", l->sent, l->lost, l->dropped, l->corrupted,
+             l->sent ? TICKS_TO_UNITS(l->waited) / l->sent : 0.0, l->maxqueue,
+             now > 0 ? (double)l->busy / now : 0.0);
+    }
+}
+#endif
+
 void init(void)                         /* initialize the simulator */
 {
   float sum, avg;
-  int i;
+  int i, askdirection;
+  char tracename[256];
+  float runfor;
+#if FORK
+  float at;
+#endif
 
   printf("-----  Stop and Wait Network Simulator Version 1.1 -------- \n\n");
   printf("Enter the number of messages to simulate: ");
@@ -187,7 +1474,14 @@ void init(void)                         /* initialize the simulator */
   scanf("%f",&lossprob);
   printf("Enter packet corruption probability [0.0 for no corruption]:");
   scanf("%f",&corruptprob);
-  if (lossprob != 0.0 || corruptprob != 0.0) {
+  /* the hops of a topology and the variants of a branched run can have
+     loss of their own, so without the question it is in both directions */
+  corruptdirection = 2;
+  askdirection = lossprob != 0.0 || corruptprob != 0.0;
+#ifdef TOPOLOGY
+  askdirection = 1;
+#endif
+  if (askdirection) {
     printf("If you want loss or corruption to only occur in one direction, choose the direction: 0 A->B, 1 A<-B, 2 A<->B (both directions) :");
     scanf("%d",&corruptdirection);
   }
@@ -195,7 +1489,64 @@ void init(void)                         /* initialize the simulator */
   scanf("%f",&lambda);
   printf("Enter TRACE:");
   scanf("%d",&TRACE);
-
+  printf("Enter the number of flows sharing the channel [1 for a single A/B pair]:");
+  scanf("%d",&nflows);
+  if (nflows < 1)
+    nflows = 1;
+  printf("Enter the workload [0 uniform, 1 saturating, 2 Poisson, 3 on/off, 4 trace file]:");
+  scanf("%d",&workload);
+  if (workload == ONOFF) {
+    printf("Enter the mean lengths of the bursts and of the silences between them:");
+    scanf("%f %f",&onmean,&offmean);
+  }
+  else if (workload == TRACEFILE) {
+    printf("Enter the name of the trace file:");
+    scanf("%255s",tracename);
+  }
+  else if (workload == SATURATING) {
+    printf("Enter the time to run for [ > 0.0]:");
+    runfor = 10000.0;
+    scanf("%f",&runfor);
+    if (runfor <= 0.0)
+      runfor = 10000.0;
+    stopat = UNITS_TO_TICKS(runfor);
+  }
+  else if (workload < UNIFORM || workload > TRACEFILE)
+    workload = UNIFORM;
+#if PDES
+  printf("Enter the number of threads [1 for the sequential emulator]:");
+  scanf("%d",&nparts);
+  if (nparts > 2*nflows)
+    nparts = 2*nflows;        /* one entity per partition at most */
+  if (nparts < 1)
+    nparts = 1;
+  if (nparts > 1)
+    TRACE = 0;                /* the threads' traces would be interleaved */
+#endif
+#if PAIRED > 0
+  printf("Enter the file to save the replications in:");
+  scanf("%255s",pairedfile);
+  printf("Enter the file of the other protocol's replications [- for none]:");
+  scanf("%255s",pairedwith);
+#endif
+#if FORK
+  printf("Enter the time to branch into variants at [0 for no branching]:");
+  scanf("%f",&at);
+  if (at > 0) {
+    printf("Enter the number of variants:");
+    scanf("%d",&nvariants);
+    variants = calloc(nvariants > 0 ? nvariants : 1, sizeof(struct variant));
+    if (variants == 0) {
+      printf("memory allocation for variants failed.");
+      exit(EXIT_FAILURE);
+    }
+    for (i=0; i<nvariants; i++) {
+      printf("Enter loss probability, corruption probability and average time between messages for variant %d:", i+1);
+      scanf("%f %f %f", &variants[i].lossprob, &variants[i].corruptprob, &variants[i].lambda);
+    }
+    branchat = UNITS_TO_TICKS(at);
+  }
+#endif
 
   srand(9999);              /* init random number generator */
   sum = 0.0;                /* test random number generator for students */
@@ -215,6 +1566,11 @@ void init(void)                         /* initialize the simulator */
   packets_resent = 0;
   new_ACKs = 0;
   packets_received = 0;
+  parity_sent = 0;
+  fec_recovered = 0;
+  naks_sent = 0;
+  gaps_filled = 0;
+  gap_time = 0.0;
   packets_lost = 0;  
   packets_corrupt = 0;
   packets_sent = 0;
@@ -225,8 +1581,42 @@ void init(void)                         /* initialize the simulator */
   nlost = 0;
   ncorrupt = 0;
 
-  time=0.0;                    /* initialize time to 0.0 */
-  generate_next_arrival();     /* initialize event list */
+  flows = calloc(nflows, sizeof(struct flow));
+  timers = calloc(2*nflows, sizeof(struct event *));
+  entityhash = malloc(2*nflows * sizeof(uint64_t));
+  chanlast = calloc(2, sizeof(simtime_t));
+  parts = calloc(nparts, sizeof(struct partition));
+  if (flows == 0 || timers == 0 || entityhash == 0 || chanlast == 0 || parts == 0) {
+    printf("memory allocation for flows failed.");
+    exit(EXIT_FAILURE);
+  }
+  for (i=0; i<2*nflows; i++)
+    entityhash[i] = 0xcbf29ce484222325ULL;   /* FNV offset basis */
+  for (i=0; i<nparts; i++)
+    parts[i].next = NEVER;
+#if PAIRED > 0
+  pairreplicate();
+#endif
+  for (i=0; i<nflows; i++)
+    flows[i].rng = streamseed(2 + i);
+  if (workload == TRACEFILE)
+    readtrace(tracename);
+#ifdef TOPOLOGY
+  readtopology(TOPOLOGY);
+#endif
+  chanrng[A] = streamseed(A);
+  chanrng[B] = streamseed(B);
+
+  if (SAMPLE_INTERVAL > 0 || SAMPLE_EVENTS > 0)
+    sampleropen();
+
+#if PRECISION > 0 && BATCHSIZE == 0
+  replicate();
+#endif
+
+  now=0;                       /* initialize time to 0 */
+  for (i=0; i<nflows; i++)
+    generate_next_arrival(i);  /* initialize event list */
 }
 
 /********************** Student-callable ROUTINES ***********************/
@@ -236,48 +1626,35 @@ void stoptimer(int AorB)
 /* A or B is trying to stop timer */
 {
   struct event *q;
+  PROF_BEGIN(prof0);
 
   if (TRACE>1)
-    printf("          STOP TIMER: stopping timer at %f\n",time);
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-  for (q=evlist; q!=NULL ; q = q->next) 
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) { 
-      /* remove this event */
-      if (q->next==NULL && q->prev==NULL)
-        evlist=NULL;         /* remove first and only event on list */
-      else if (q->next==NULL) /* end of list - there is one in front */
-        q->prev->next = NULL;
-      else if (q==evlist) { /* front of list - there must be event after */
-        q->next->prev=NULL;
-        evlist = q->next;
-      }
-      else {     /* middle of list */
-        q->next->prev = q->prev;
-        q->prev->next =  q->next;
-      }
-      free(q);
-      return;
-    }
-  printf("Warning: unable to cancel your timer. It wasn't running.\n");
+    printf("          STOP TIMER: stopping timer at %f\n",TICKS_TO_UNITS(now));
+  q = timers[2*curflow + AorB];
+  if (q == NULL) {
+    printf("Warning: unable to cancel your timer. It wasn't running.\n");
+    return;
+  }
+  removeevent(q);
+  timers[2*curflow + AorB] = NULL;
+  free(q);
+  PROF_END(PROF_STOPTIMER, prof0);
 }
 
 
-void starttimer(int AorB, double increment)
+void starttimer_ticks(int AorB, simtime_t increment)
 /* A or B is trying to start timer */
 {
-
-  struct event *q;
   struct event *evptr;
+  PROF_BEGIN(prof0);
 
   if (TRACE>1)
-    printf("          START TIMER: starting timer at %f\n",time);
+    printf("          START TIMER: starting timer at %f\n",TICKS_TO_UNITS(now));
   /* be nice: check to see if timer is already started, if so, then  warn */
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-  for (q=evlist; q!=NULL ; q = q->next)  
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) { 
-      printf("Warning: attempt to start a timer that is already started\n");
-      return;
-    }
+  if (timers[2*curflow + AorB] != NULL) {
+    printf("Warning: attempt to start a timer that is already started\n");
+    return;
+  }
  
   /* create future event for when timer goes off */
   evptr = malloc(sizeof(struct event));
@@ -285,28 +1662,75 @@ void starttimer(int AorB, double increment)
     printf("memory allocation for event failed.");
     exit(EXIT_FAILURE);
   }
-  evptr->evtime =  time + increment;
+  evptr->evtime =  now + increment;
   evptr->evtype =  TIMER_INTERRUPT;
    
  
   evptr->eventity = AorB;
+  evptr->evflow = curflow;
+  timers[2*curflow + AorB] = evptr;
   insertevent(evptr);
+  PROF_END(PROF_STARTTIMER, prof0);
 } 
 
+/* increment in time units, kept for protocols written against floats */
+void starttimer(int AorB, double increment)
+{
+  starttimer_ticks(AorB, UNITS_TO_TICKS(increment));
+}
+
+simtime_t get_sim_ticks(void)
+{
+  return now;
+}
+
 
 /************************** TOLAYER3 ***************/
 void tolayer3(int AorB, struct pkt packet)
 /* A or B is sending to network  */
 {
   struct pkt *mypktptr;
-  struct event *evptr,*q;
-  float lastime, x;
+  struct event *evptr;
+  simtime_t lastime;
   int i;
 
+  /* in a parallel window, keep the packet for the channel to take later */
+  if (inwindow && nparts > 1) {
+    struct partition *q = &parts[OWNER(curflow, AorB)];
+    if (q->nout == q->outsize) {
+      q->outsize = q->outsize ? 2*q->outsize : 64;
+      q->out = realloc(q->out, q->outsize * sizeof(struct send));
+      if (q->out == 0) {
+        printf("memory allocation for outbox failed.");
+        exit(EXIT_FAILURE);
+      }
+    }
+    q->out[q->nout].key = *curevent;
+    q->out[q->nout].from = AorB;
+    q->out[q->nout].packet = packet;
+    q->nout++;
+    return;
+  }
+
   ntolayer3++;
+  nsentby[AorB]++;
+#if PAIRED > 0
+  keytransmission(AorB, &packet);
+#endif
+
+#ifdef TOPOLOGY
+  mypktptr = malloc(sizeof(struct pkt));
+  if (mypktptr == 0) {
+    printf("memory allocation for event failed.");
+    exit(EXIT_FAILURE);
+  }
+  *mypktptr = packet;
+  sendhop(AorB == A ? 0 : nhops-1, (AorB+1) % 2, mypktptr);
+  return;
+#endif
 
   /* simulate losses: */
-  if (jimsrand() < lossprob && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
+  if (CHANRAND(AorB) < lossprob && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
     nlost++;
     if (TRACE>0)    
       printf("          TOLAYER3: packet being lost\n");
@@ -341,40 +1765,113 @@ void tolayer3(int AorB, struct pkt packet)
   }
   evptr->evtype =  FROM_LAYER3;   /* packet will pop out from layer3 */
   evptr->eventity = (AorB+1) % 2; /* event occurs at other entity */
+  evptr->evflow = curflow;        /* packets of all flows share the medium */
   evptr->pktptr = mypktptr;       /* save ptr to my copy of packet */
   /* finally, compute the arrival time of packet at the other end.
      medium can not reorder, so make sure packet arrives between 1 and 10
      time units after the latest arrival time of packets
      currently in the medium on their way to the destination */
-  lastime = time;
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next) */
-  for (q=evlist; q!=NULL ; q = q->next) 
-    if ( (q->evtype==FROM_LAYER3  && q->eventity==evptr->eventity) ) 
-      lastime = q->evtime;
-  evptr->evtime =  lastime + 1 + 9*jimsrand();
+  lastime = now;
+  if (chanlast[evptr->eventity] > lastime)
+    lastime = chanlast[evptr->eventity];
+  evptr->evtime =  lastime + UNITS_TO_TICKS(1 + 9*CHANRAND(AorB));
+  chanlast[evptr->eventity] = evptr->evtime;
+  inflight[evptr->eventity]++;
  
 
 
   /* simulate corruption: */
-  if ((jimsrand() < corruptprob)  && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
-    ncorrupt++;
-    if ( (x = jimsrand()) < .75)
-      mypktptr->payload[0]='Z';   /* corrupt payload */
-    else if (x < .875)
-      mypktptr->seqnum = 999999;
-    else
-      mypktptr->acknum = 999999;
-    if (TRACE>0)    
-      printf("          TOLAYER3: packet being corrupted\n");
-  }  
+  if ((CHANRAND(AorB) < corruptprob)  && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B)))
+    corrupt(mypktptr, AorB);
 
   if (TRACE>2)  
     printf("          TOLAYER3: scheduling arrival on other side\n");
-  insertevent(evptr);
+  schedule(evptr);
 } 
 
+/********************* DELIVERY CHECK ****************/
+/* Every message that A accepts is remembered in its flow's pend ring with
+   its number and a digest of its data, and whatever B delivers to layer 5
+   must be the oldest of them, intact.  Data that is corrupted, delivered
+   twice, out of order or not at all ends the run with a description of
+   what went wrong.  It costs a 20 byte hash per message; build with
+   -DVERIFY=0 to turn it off. */
+#ifndef VERIFY
+#define VERIFY 1
+#endif
+
+static uint32_t digest(const char data[20])   /* FNV-1a */
+{
+  uint32_t h = 2166136261u;
+  int i;
+
+  for (i=0; i<20; i++)
+    h = (h ^ (unsigned char)data[i]) * 16777619u;
+  return h;
+}
+
+static void printdata(const char data[20])
+{
+  int i;
+
+  putchar('"');
+  for (i=0; i<20; i++)
+    putchar(data[i] >= ' ' && data[i] <= '~' ? data[i] : '.');
+  putchar('"');
+}
+
+/* B delivered data that is not the next message of the flow */
+static void baddelivery(struct flow *fl, char data[20])
+{
+  uint32_t d = digest(data);
+  unsigned pushed = PEEK(fl->pushed), k;
+
+  printf("DELIVERY CHECK FAILED: flow %d delivered ", curflow);
+  printdata(data);
+  printf(" at time %f\n", TICKS_TO_UNITS(now));
+  if (fl->popped == pushed)
+    printf("  no message of the flow was waiting to be delivered");
+  else
+    printf("  expected message %d, generated at time %f",
+           fl->pend[fl->popped % MAXPENDING].id,
+           TICKS_TO_UNITS(fl->pend[fl->popped % MAXPENDING].gentime));
+  for (k = fl->popped + 1; k != pushed; k++)
+    if (fl->pend[k % MAXPENDING].digest == d) {
+      printf(", got message %d: messages delivered out of order or skipped\n",
+             fl->pend[k % MAXPENDING].id);
+      exit(EXIT_FAILURE);
+    }
+  if (fl->delivered > 1 && fl->last.digest == d)
+    printf(", got message %d again: duplicate delivery\n", fl->last.id);
+  else
+    printf(", got data of no outstanding message: corrupted delivery\n");
+  exit(EXIT_FAILURE);
+}
+
+/* at the end every accepted message must have been delivered */
+static int checkdelivered(void)
+{
+  struct flow *fl;
+  struct pending *pm;
+  int i, bad = 0;
+
+  for (i=0; i<nflows; i++) {
+    fl = &flows[i];
+    if (fl->pushed != fl->popped) {
+      pm = &fl->pend[fl->popped % MAXPENDING];
+      printf("DELIVERY CHECK FAILED: flow %d never delivered message %d, generated at time %f (%u undelivered)\n",
+             i, pm->id, TICKS_TO_UNITS(pm->gentime), fl->pushed - fl->popped);
+      bad = 1;
+    }
+  }
+  return bad;
+}
+
 void tolayer5(int AorB, char datasent[20])
 {
+  struct flow *fl = &flows[curflow];
+  struct pending *pm;
+  simtime_t latency;
   int i;  
   if (TRACE>2) {
     printf("          TOLAYER5: data received by application at ");
@@ -387,92 +1884,546 @@ void tolayer5(int AorB, char datasent[20])
     printf("\n");
   }
   messages_delivered++;
+  if (AorB == B) {
+    fl->delivered++;
+    /* messages are delivered in the order they were accepted, so the
+       oldest pending generation time belongs to this message */
+    if (PEEK(fl->pushed) != fl->popped) {
+      pm = &fl->pend[fl->popped % MAXPENDING];
+      if (VERIFY && digest(datasent) != pm->digest)
+        baddelivery(fl, datasent);
+      fl->last = *pm;
+      latency = now - pm->gentime;
+      POKE(fl->popped, fl->popped + 1);
+      fl->latsum += latency;
+      if (latency > fl->latmax)
+        fl->latmax = latency;
+#if PRECISION > 0
+      recordlatency(latency);
+#endif
+    }
+    else if (VERIFY)
+      baddelivery(fl, datasent);
+  }
 }
 
-int main(void)
+/* print goodput, fairness and latency of the flows */
+void printflowstats(void)
+{
+  struct flow *fl;
+  double goodput, sum = 0.0, sumsq = 0.0, latsum = 0.0;
+  simtime_t latmax = 0;
+  int i, delivered = 0;
+
+  if (now <= 0)
+    return;
+  for (i=0; i<nflows; i++) {
+    fl = &flows[i];
+    goodput = fl->delivered / TICKS_TO_UNITS(now);
+    sum += goodput;
+    sumsq += goodput * goodput;
+    latsum += TICKS_TO_UNITS(fl->latsum);
+    delivered += fl->delivered;
+    if (fl->latmax > latmax)
+      latmax = fl->latmax;
+    if (nflows > 1 && (nflows <= 32 || TRACE > 0))
+      printf("flow %d: delivered %d, goodput %f msgs/time unit, mean latency %f, max latency %f\n",
+             i, fl->delivered, goodput,
+             fl->delivered ? TICKS_TO_UNITS(fl->latsum) / fl->delivered : 0.0,
+             TICKS_TO_UNITS(fl->latmax));
+  }
+  printf("aggregate goodput:  %f msgs/time unit over %d flows\n", sum, nflows);
+  if (nflows > 1)
+    printf("Jain fairness index of flow goodputs:  %f \n",
+           sumsq > 0.0 ? (sum * sum) / (nflows * sumsq) : 1.0);
+  printf("mean delivery latency:  %f, max delivery latency:  %f \n",
+         delivered ? latsum / delivered : 0.0, TICKS_TO_UNITS(latmax));
+}
+
+/********************* FINGERPRINT *******************/
+/* Every event is folded into a rolling hash: its time, type, entity and
+   flow, and the header and payload of the packet it carries.  Each entity
+   has a hash of its own, so that the parallel emulator gets the same
+   fingerprint with any number of threads; the fingerprint of the run is
+   the hash of theirs.  Two runs with the same fingerprint simulated the
+   same events, so a change to the scheduler or the protocols can be
+   checked without diffing traces.  Build with -DCHECKPOINT=<n> to print
+   the fingerprint so far every n events, and narrow a difference down by
+   running again with a smaller n. */
+#ifndef CHECKPOINT
+#define CHECKPOINT 0
+#endif
+#if PDES && CHECKPOINT > 0
+#error "checkpoints are not available in the parallel emulator"
+#endif
+
+#define FOLD(h, v)  ((h) = ((h) ^ (uint64_t)(v)) * 0x100000001b3ULL)
+
+static void fingerprintevent(struct event *e)
+{
+  uint64_t *h = &entityhash[2*e->evflow + e->eventity];
+  int i;
+
+  FOLD(*h, e->evtime);
+  FOLD(*h, e->evtype);
+  if (e->evtype == FROM_LAYER3 || e->evtype == FROM_HOP) {
+    FOLD(*h, (uint32_t)e->pktptr->seqnum);
+    FOLD(*h, (uint32_t)e->pktptr->acknum);
+    FOLD(*h, (uint32_t)e->pktptr->checksum);
+    for (i=0; i<20; i++)
+      FOLD(*h, (unsigned char)e->pktptr->payload[i]);
+  }
+}
+
+static uint64_t fingerprint(void)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  int i;
+
+  for (i=0; i<2*nflows; i++)
+    FOLD(h, entityhash[i]);
+  return h;
+}
+
+/* give the next message of the current flow to entity A or B.  A
+   saturating source keeps a message that A refuses and offers it again
+   later, so it does not count as dropped */
+static void offer(struct flow *fl, int entity)
 {
-  struct event *eventptr;
   struct msg  msg2give;
+  struct pending *pm;
+  int i,j,dropped;
+
+  /* fill in msg to give with string of same letter */    
+  j = fl->nsim % 26; 
+  for (i=0; i<20; i++)  
+    msg2give.data[i] = 97 + j;
+  if (TRACE>2) {
+    printf("          MAINLOOP: data given to student: ");
+    for (i=0; i<20; i++) 
+      printf("%c", msg2give.data[i]);
+    printf("\n");
+  }
+  if (entity == A) {
+    if (PAIRED > 0) {            /* before A_output sends it */
+      fl->lastid[j] = fl->nsim;
+      fl->sends[j] = 0;
+    }
+    dropped = window_full;
+    PROF_BEGIN(prof2);
+    A_output(msg2give);  
+    PROF_END(PROF_A_OUTPUT, prof2);
+    if (window_full != dropped && workload == SATURATING) {
+      window_full = dropped;
+      fl->blocked = 1;
+      return;
+    }
+    nsim++;
+    fl->nsim++;
+    /* remember when accepted messages were generated */
+    if (window_full == dropped) {
+      if (fl->pushed - PEEK(fl->popped) < MAXPENDING) {
+        pm = &fl->pend[fl->pushed % MAXPENDING];
+        pm->gentime = now;
+        pm->id = fl->nsim - 1;
+        pm->digest = digest(msg2give.data);
+        POKE(fl->pushed, fl->pushed + 1);
+      }
+      else if (VERIFY) {
+        printf("DELIVERY CHECK: more than %d messages of flow %d in flight, raise MAXPENDING\n",
+               MAXPENDING, curflow);
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+  else {
+    nsim++;
+    fl->nsim++;
+    PROF_BEGIN(prof2);
+    B_output(msg2give);  
+    PROF_END(PROF_B_OUTPUT, prof2);
+  }
+}
+
+/* saturating source: offer A messages until its window is full */
+static void saturate(struct flow *fl)
+{
+  fl->blocked = 0;
+  while (!fl->blocked && fl->nsim < nsimmax)
+    offer(fl, A);
+}
+
+/* simulate an event that has been taken off the event list */
+static void dispatch(struct event *eventptr)
+{
   struct pkt  pkt2give;
+  struct flow *fl;
    
-  int i,j;
-  
+  int i;
+
+  fingerprintevent(eventptr);
+  if (TRACE>=2) {
+    printf("\nEVENT time: %f,",TICKS_TO_UNITS(eventptr->evtime));
+    printf("  type: %d",eventptr->evtype);
+    if (eventptr->evtype==0)
+      printf(", timerinterrupt  ");
+    else if (eventptr->evtype==1)
+      printf(", fromlayer5 ");
+    else if (eventptr->evtype==FROM_HOP)
+      printf(", at router %d ", eventptr->eventity == B ? eventptr->evhop : eventptr->evhop + 1);
+    else
+      printf(", fromlayer3 ");
+    printf(" entity: %d",eventptr->eventity);
+    if (nflows > 1)
+      printf(" flow: %d",eventptr->evflow);
+    printf("\n");
+  }
+  now = eventptr->evtime;         /* update time to next event time */
+  curflow = eventptr->evflow;     /* entities called below act for this flow */
+  curevent = eventptr;
+  fl = &flows[curflow];
+  PROF_BEGIN(prof1);
+  if (eventptr->evtype == FROM_LAYER5 ) {
+    if (fl->nsim < nsimmax) {
+      if (workload == SATURATING)
+        saturate(fl);
+      else {
+        generate_next_arrival(curflow);   /* set up future arrival */
+        offer(fl, eventptr->eventity);
+      }
+    }
+    else if (TRACE > 2)
+        printf("          FROM_LAYER5: no more messages to send: \n");
+    PROF_END(PROF_FROMLAYER5, prof1);
+  }
+  else if (eventptr->evtype ==  FROM_LAYER3) {
+    inflight[eventptr->eventity]--;
+    pkt2give.seqnum = eventptr->pktptr->seqnum;
+    pkt2give.acknum = eventptr->pktptr->acknum;
+    pkt2give.checksum = eventptr->pktptr->checksum;
+    for (i=0; i<20; i++)  
+      pkt2give.payload[i] = eventptr->pktptr->payload[i];
+    if (eventptr->eventity ==A) {    /* deliver packet by calling */
+      PROF_BEGIN(prof2);
+      A_input(pkt2give);            /* appropriate entity */
+      PROF_END(PROF_A_INPUT, prof2);
+      if (fl->blocked)
+        saturate(fl);               /* the window may have opened */
+    }
+    else {
+      PROF_BEGIN(prof2);
+      B_input(pkt2give);
+      PROF_END(PROF_B_INPUT, prof2);
+    }
+    free(eventptr->pktptr);          /* free the memory for packet */
+    PROF_END(PROF_FROMLAYER3, prof1);
+  }
+#ifdef TOPOLOGY
+  else if (eventptr->evtype ==  FROM_HOP) {
+    inflight[eventptr->eventity]--;
+    sendhop(eventptr->evhop, eventptr->eventity, eventptr->pktptr);
+  }
+#endif
+  else if (eventptr->evtype ==  TIMER_INTERRUPT) {
+    timers[2*curflow + eventptr->eventity] = NULL;
+    if (eventptr->eventity == A) {
+      PROF_BEGIN(prof2);
+      A_timerinterrupt();
+      PROF_END(PROF_A_TIMER, prof2);
+    }
+    else {
+      PROF_BEGIN(prof2);
+      B_timerinterrupt();
+      PROF_END(PROF_B_TIMER, prof2);
+    }
+    PROF_END(PROF_TIMER, prof1);
+  }
+  else  {
+    printf("INTERNAL PANIC: unknown event type \n");
+  }
+  free(eventptr);
+  nevents_done++;
+}
+
+/********************* PARALLEL EMULATOR *************/
+/* With PDES the entities are split over nparts partitions: A's side of
+   flow f goes to partition 2f % nparts and B's side to (2f+1) % nparts,
+   and each partition is simulated by a thread of its own.  Entities only
+   affect each other through the channel, and a packet takes at least one
+   time unit to cross it, so with T the time of the earliest pending event
+   every partition can simulate [T, T+1) at the same time as the others.
+   Packets sent in a window wait in the sender's outbox.  Between windows
+   thread 0 takes them in the order the sequential emulator would have sent
+   them and puts them through the channel, which leaves the arrivals in the
+   inboxes of the receivers.  Each box has one writer at a time and changes
+   hands at the barrier, so no locks are needed.
+   The channel and the arrivals use random streams of their own in a PDES
+   build, and ties are broken as in evbefore, so the output is the same bit
+   for bit whatever the number of threads; 1 runs the sequential loop. */
+#if PDES
+#if PROFILE || SAMPLE_INTERVAL > 0 || SAMPLE_EVENTS > 0
+#error "profiling and sampling are not available in the parallel emulator"
+#endif
+
+static simtime_t windowend;     /* end of the window being simulated */
+static int finished;            /* no events are left */
+static int barriercount, barriersense;
+static SIMLOCAL int mysense;
+
+/* wait for every thread to get here */
+static void pbarrier(void)
+{
+  int sense = mysense = !mysense;
+  int spins = 0;
+
+  if (__atomic_add_fetch(&barriercount, 1, __ATOMIC_ACQ_REL) == nparts) {
+    __atomic_store_n(&barriercount, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&barriersense, sense, __ATOMIC_RELEASE);
+  }
+  else
+    while (__atomic_load_n(&barriersense, __ATOMIC_ACQUIRE) != sense)
+      if (++spins > 1000)
+        sched_yield();
+}
+
+/* simulate the events of partition p that are before windowend */
+static void runwindow(struct partition *p)
+{
+  struct event *eventptr;
+  int i;
+
+  for (i=0; i<p->nin; i++)
+    insertevent(p->in[i]);
+  p->nin = 0;
+  inwindow = 1;
+  while (nevents > 0 && evheap[0]->evtime < windowend) {
+    eventptr = evheap[0];
+    removeevent(eventptr);
+    dispatch(eventptr);
+    p->last = now;
+  }
+  inwindow = 0;
+  p->next = nevents > 0 ? evheap[0]->evtime : NEVER;
+}
+
+/* send the packets in the outboxes in simulated order */
+static void runchannel(void)
+{
+  struct send *sp;
+  int k, best;
+
+  for (k=0; k<nparts; k++)
+    parts[k].outpos = 0;
+  while (1) {
+    best = -1;
+    for (k=0; k<nparts; k++)
+      if (parts[k].outpos < parts[k].nout &&
+          (best < 0 || evbefore(&parts[k].out[parts[k].outpos].key,
+                                &parts[best].out[parts[best].outpos].key)))
+        best = k;
+    if (best < 0)
+      break;
+    sp = &parts[best].out[parts[best].outpos++];
+    now = sp->key.evtime;
+    curflow = sp->key.evflow;
+    tolayer3(sp->from, sp->packet);
+  }
+  for (k=0; k<nparts; k++)
+    parts[k].nout = 0;
+}
+
+static void *worker(void *arg)
+{
+  struct partition *p = arg;
+
+  while (1) {
+    pbarrier();                 /* window set up */
+    if (finished)
+      break;
+    runwindow(p);
+    pbarrier();                 /* window simulated */
+  }
+  p->sums[0] = window_full;
+  p->sums[1] = total_ACKs_received;
+  p->sums[2] = packets_resent;
+  p->sums[3] = new_ACKs;
+  p->sums[4] = packets_received;
+  p->sums[5] = messages_delivered;
+  p->sums[6] = nsim;
+  p->sums[7] = parity_sent;
+  p->sums[8] = fec_recovered;
+  p->sums[9] = naks_sent;
+  p->sums[10] = gaps_filled;
+  p->gaptime = gap_time;
+  p->nevents = nevents_done;
+  return NULL;
+}
+
+void runparallel(void)
+{
+  simtime_t next;
+  int i;
+
+  for (i=1; i<nparts; i++)
+    if (pthread_create(&parts[i].thread, NULL, worker, &parts[i]) != 0) {
+      printf("unable to start thread %d.", i);
+      exit(EXIT_FAILURE);
+    }
+  while (1) {
+    runchannel();
+    next = NEVER;
+    for (i=0; i<nparts; i++)
+      if (parts[i].next < next)
+        next = parts[i].next;
+    if (next > stopat)
+      timeup = 1;
+    if (next == NEVER || timeup)
+      finished = 1;
+    else if (next + UNITS_TO_TICKS(1) > stopat)
+      windowend = stopat + 1;     /* stop at the time limit */
+    else
+      windowend = next + UNITS_TO_TICKS(1);
+    pbarrier();
+    if (finished)
+      break;
+    runwindow(&parts[0]);
+    pbarrier();
+  }
+
+  /* add up what the other threads counted */
+  now = parts[0].last;
+  for (i=1; i<nparts; i++) {
+    pthread_join(parts[i].thread, NULL);
+    window_full += parts[i].sums[0];
+    total_ACKs_received += parts[i].sums[1];
+    packets_resent += parts[i].sums[2];
+    new_ACKs += parts[i].sums[3];
+    packets_received += parts[i].sums[4];
+    messages_delivered += parts[i].sums[5];
+    nsim += parts[i].sums[6];
+    parity_sent += parts[i].sums[7];
+    fec_recovered += parts[i].sums[8];
+    naks_sent += parts[i].sums[9];
+    gaps_filled += parts[i].sums[10];
+    gap_time += parts[i].gaptime;
+    nevents_done += parts[i].nevents;
+    if (parts[i].last > now)
+      now = parts[i].last;
+  }
+}
+#endif
+
+int main(void)
+{
+  struct event *eventptr;
+
   init();
   A_init();
   B_init();
    
+  PROF_BEGIN(profstart);
+#if PDES
+  if (nparts > 1)
+    runparallel();
+  else
+#endif
   while (1) {
-    eventptr = evlist;            /* get next event to simulate */
-    if (eventptr==NULL)
+    if (nevents == 0)             /* get next event to simulate */
+      goto terminate;
+    if (evheap[0]->evtime > stopat) {
+      timeup = 1;
       goto terminate;
-    evlist = evlist->next;        /* remove this event from event list */
-    if (evlist!=NULL)
-      evlist->prev=NULL;
-    if (TRACE>=2) {
-      printf("\nEVENT time: %f,",eventptr->evtime);
-      printf("  type: %d",eventptr->evtype);
-      if (eventptr->evtype==0)
-        printf(", timerinterrupt  ");
-      else if (eventptr->evtype==1)
-        printf(", fromlayer5 ");
-      else
-        printf(", fromlayer3 ");
-      printf(" entity: %d\n",eventptr->eventity);
-    }
-    time = eventptr->evtime;        /* update time to next event time */
-    if (eventptr->evtype == FROM_LAYER5 ) {
-      if (nsim < nsimmax) {
-        generate_next_arrival();   /* set up future arrival */
-        /* fill in msg to give with string of same letter */    
-        j = nsim % 26; 
-        for (i=0; i<20; i++)  
-          msg2give.data[i] = 97 + j;
-        if (TRACE>2) {
-          printf("          MAINLOOP: data given to student: ");
-          for (i=0; i<20; i++) 
-            printf("%c", msg2give.data[i]);
-          printf("\n");
-        }
-        nsim++;
-        if (eventptr->eventity == A) 
-          A_output(msg2give);  
-        else
-          B_output(msg2give);  
-      }
-      else if (TRACE > 2)
-          printf("          FROM_LAYER5: no more messages to send: \n");
-    }
-    else if (eventptr->evtype ==  FROM_LAYER3) {
-      pkt2give.seqnum = eventptr->pktptr->seqnum;
-      pkt2give.acknum = eventptr->pktptr->acknum;
-      pkt2give.checksum = eventptr->pktptr->checksum;
-      for (i=0; i<20; i++)  
-        pkt2give.payload[i] = eventptr->pktptr->payload[i];
-	    if (eventptr->eventity ==A)      /* deliver packet by calling */
-        A_input(pkt2give);            /* appropriate entity */
-      else
-        B_input(pkt2give);
-	    free(eventptr->pktptr);          /* free the memory for packet */
-    }
-    else if (eventptr->evtype ==  TIMER_INTERRUPT) {
-      if (eventptr->eventity == A) 
-        A_timerinterrupt();
-      else
-        B_timerinterrupt();
-    }
-    else  {
-      printf("INTERNAL PANIC: unknown event type \n");
     }
-    free(eventptr);
+#if FORK
+    if (evheap[0]->evtime >= branchat)
+      branch();
+#endif
+    if (SAMPLE_INTERVAL > 0)
+      for (; nextsample <= evheap[0]->evtime; nextsample += UNITS_TO_TICKS(SAMPLE_INTERVAL))
+        takesample(nextsample);  /* state is constant between events */
+    PROF_BEGIN(prof0);
+    eventptr = evheap[0];
+    removeevent(eventptr);        /* remove this event from event list */
+    PROF_END(PROF_POP, prof0);
+    dispatch(eventptr);
+    if (SAMPLE_EVENTS > 0 && nevents_done % SAMPLE_EVENTS == 0)
+      takesample(now);
+    if (CHECKPOINT > 0 && nevents_done % CHECKPOINT == 0)
+      printf("checkpoint after %ld events, time %f: %016llx\n", nevents_done,
+             TICKS_TO_UNITS(now), (unsigned long long)fingerprint());
+#if PRECISION > 0
+    if (stopnow)
+      goto terminate;
+#endif
   }
 
  terminate:
-  printf(" Simulator terminated at time %f\n after attempting to send %d msgs from layer5\n",time,nsim);
+#if PROFILE
+  profloop = cycles() - profstart;
+#endif
+  if (timeup)
+    now = stopat;
+  printf(" Simulator terminated at time %f\n after attempting to send %d msgs from layer5\n",TICKS_TO_UNITS(now),nsim);
+  if (timeup)
+    printf("the run reached its time limit, the loads below are up to it\n");
   printf("number of messages dropped due to full window:  %d \n", window_full);
   printf("number of valid (not corrupt or duplicate) acknowledgements received at A:  %d \n", new_ACKs);
   printf("(note: a single acknowledgement may have acknowledged more than one packet - if cumulative acknowledgements are used)\n");
   printf("number of packet resends by A:  %d \n", packets_resent);
   printf("number of correct packets received at B:  %d \n", packets_received);
   printf("number of messages delivered to application:  %d \n", messages_delivered);
+  if (now > 0)
+    printf("offered load:  %f, carried load:  %f (messages per time unit) \n",
+           nsim / TICKS_TO_UNITS(now), messages_delivered / TICKS_TO_UNITS(now));
+  printf("number of packets sent into layer 3 by A:  %d, by B:  %d \n", nsentby[A], nsentby[B]);
+  if (messages_delivered > 0)
+    printf("ACK packets (sent by B) per delivered message:  %f \n", (double)nsentby[B] / messages_delivered);
+  if (parity_sent > 0)
+    printf("number of parity packets sent by A:  %d (overhead %f), packets rebuilt from parity at B:  %d \n",
+           parity_sent, (double)parity_sent / (nsentby[A] - parity_sent), fec_recovered);
+  if (gaps_filled > 0)
+    printf("holes filled in B's window:  %d, mean time to fill one:  %f, NAKs sent by B:  %d \n",
+           gaps_filled, gap_time / gaps_filled, naks_sent);
+  printflowstats();
+  printf("run fingerprint:  %016llx after %ld events \n",
+         (unsigned long long)fingerprint(), nevents_done);
+#ifdef TOPOLOGY
+  printhops();
+#endif
+#if PROFILE
+  printprofile();
+#endif
+  if (samplefp != NULL) {
+    takesample(now);
+    samplerflush();
+    fclose(samplefp);
+    printf("%ld samples written to %s\n", nsamples, SAMPLE_FILE);
+  }
+#if PRECISION > 0
+  if (BATCHSIZE > 0)
+    printintervals();
+#endif
+#if FORK
+  waitvariants();
+#endif
+  if (VERIFY && timeup)
+    printf("delivery check: run stopped at the time limit, every delivery so far in order and intact\n");
+  else
+#if PRECISION > 0
+  if (VERIFY && stopnow)
+    printf("delivery check: run stopped early, every delivery so far in order and intact\n");
+  else
+#endif
+  if (VERIFY) {
+    if (checkdelivered())
+      return EXIT_FAILURE;
+    printf("delivery check: every accepted message delivered once, in order and intact\n");
+  }
+#if PRECISION > 0 && BATCHSIZE == 0
+  reportreplication();
+#endif
+#if PAIRED > 0
+  reportpaired();
+#endif
   return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
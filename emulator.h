@@ -1,15 +1,45 @@
+#include <stdint.h>
+
+/* Build everything with -DPDES=1 for the parallel emulator.  Entities are
+   then simulated by several threads, and the variables marked SIMLOCAL
+   below have one copy per thread (the emulator adds them up at the end) */
+#ifndef PDES
+#define PDES 0
+#endif
+#if PDES
+#define SIMLOCAL _Thread_local
+#else
+#define SIMLOCAL
+#endif
+
 extern int TRACE;
 
 /* statistics updated by GBN */
-extern int total_ACKs_received;
-extern int packets_resent;       /* count of the number of packets resent  */
-extern int new_ACKs;      /* count of the number of acks correctly received */
-extern int packets_received;  /* count of the packets received by receiver */
-extern int window_full; /* count of the number of messages dropped due to full window */
+extern SIMLOCAL int total_ACKs_received;
+extern SIMLOCAL int packets_resent;       /* count of the number of packets resent  */
+extern SIMLOCAL int new_ACKs;      /* count of the number of acks correctly received */
+extern SIMLOCAL int packets_received;  /* count of the packets received by receiver */
+extern SIMLOCAL int window_full; /* count of the number of messages dropped due to full window */
+extern SIMLOCAL int parity_sent;    /* FEC: parity packets sent by A */
+extern SIMLOCAL int fec_recovered;  /* FEC: packets B rebuilt from parity */
+#define PARITY(k) (-1 - (k))        /* FEC: acknum of A's parity packet for k packets */
+extern SIMLOCAL int naks_sent;      /* NAK packets sent by B */
+extern SIMLOCAL int gaps_filled;    /* holes in B's window that were filled, */
+extern SIMLOCAL double gap_time;    /* and the time from seeing each to filling it */
+
+/* current state kept up to date by the protocols, summed over all flows */
+extern SIMLOCAL int window_occupancy;   /* packets sent by A and not yet ACKed */
+extern SIMLOCAL int receiver_buffered;  /* out of order packets held by B */
 
 #define   A    0
 #define   B    1
 
+/* several independent A/B pairs (flows) can share the channel.  Before an
+   entity routine is called the emulator sets curflow to the flow it acts
+   for; tolayer3, tolayer5, starttimer and stoptimer apply to that flow */
+extern int nflows;
+extern SIMLOCAL int curflow;
+
 /* a "msg" is the data unit passed from layer 5 (teachers code) to layer  */
 /* 4 (students' code).  It contains the data (characters) to be delivered */
 /* to layer 5 via the students transport level protocol entities.         */
@@ -33,7 +63,22 @@ extern void tolayer3(int, struct pkt);
 /* deliver to A or B (int), data to deliver */
 extern void tolayer5(int, char[20]); 
 
-/* start timer at A or B (int), increment */
+/* simulated time is counted in integer ticks.  Building with a different
+   -DTICKS_PER_UNIT changes the resolution of the clock */
+#ifndef TICKS_PER_UNIT
+#define TICKS_PER_UNIT 1000000
+#endif
+typedef int64_t simtime_t;
+#define UNITS_TO_TICKS(u) ((simtime_t)((u) * (double)TICKS_PER_UNIT + 0.5))
+#define TICKS_TO_UNITS(t) ((double)(t) / TICKS_PER_UNIT)
+
+/* current simulated time, in ticks */
+extern simtime_t get_sim_ticks(void);
+
+/* start timer at A or B (int), increment in ticks */
+extern void starttimer_ticks(int, simtime_t);
+
+/* start timer at A or B (int), increment in time units */
 extern void starttimer(int, double);       
 
 /* stop timer at A or B (int) */
@@ -20,14 +20,51 @@
    - removed bidirectional GBN code and other code not used by prac.
    - fixed C style to adhere to current programming style
    - added GBN implementation
+   - per flow state, so that many flows can share the emulator
+   - optional selective acknowledgements (SACK)
+   - optional delayed and coalesced ACKs at the receiver
+   - optional forward error correction with XOR parity packets
 **********************************************************************/
 
 #define RTT  16.0       /* round trip time.  MUST BE SET TO 16.0 when submitting assignment */
 #define WINDOWSIZE 6    /* the maximum number of buffered unacked packet
                           MUST BE SET TO 6 when submitting assignment */
+#ifndef SACK
+#define SACK 0          /* 1 = selective acknowledgements, build with -DSACK=1 */
+#endif
+#ifndef FEC
+#define FEC 0           /* k = a parity packet every k data packets, build with -DFEC=k */
+#endif
+#ifndef FEC_ADAPT
+#define FEC_ADAPT 0     /* 1 = k follows the loss rate, build with -DFEC_ADAPT=1 */
+#endif
+#if FEC < 0 || FEC > WINDOWSIZE || (FEC_ADAPT && !FEC)
+#error "FEC must be between 1 and WINDOWSIZE, and FEC_ADAPT needs it as the starting k"
+#endif
+#if SACK || FEC
+#define SEQSPACE (2*WINDOWSIZE) /* B buffers out of order packets, so like SR it needs 2 * windowsize */
+#else
 #define SEQSPACE 7      /* the min sequence space for GBN must be at least windowsize + 1 */
+#endif
 #define NOTINUSE (-1)   /* used to fill header fields that are not being used */
 
+/* SACK: ACKs still carry the cumulative ACK in acknum, and their payload is
+   a receive bitmap.  payload[i] is '1' if packet acknum+1+i is buffered at
+   B, '0' otherwise.  B keeps out of order packets within its window and
+   A retransmits only the packets that are neither ACKed nor SACKed. */
+
+/* FEC: after every k new data packets A sends a parity packet, with the
+   seqnum of the first of them, acknum PARITY(k) and the XOR of their
+   payloads.  Retransmissions are not part of any group.  The channel keeps
+   packets in order, so when the parity reaches B the rest of its group
+   has arrived or been lost, and if just one is missing B rebuilds it at
+   once instead of waiting for A's timer.  To have the others at hand B
+   buffers out of order packets as with SACK, and keeps the payloads it
+   has delivered.  With FEC_ADAPT, k is the largest that expects at most
+   half a lost packet per group of k+1, but at least 2, taking timeouts
+   per packet as the loss rate. */
+#define BUFFERED (SACK || FEC)  /* B keeps out of order packets */
+
 /* generic procedure to compute the checksum of a packet.  Used by both sender and receiver
    the simulator will overwrite part of your packet with 'z's.  It will not overwrite your
    original checksum.  This procedure must generate a different checksum to the original if
@@ -57,24 +94,81 @@ bool IsCorrupted(struct pkt packet)
 
 /********* Sender (A) variables and functions ************/
 
-static struct pkt buffer[WINDOWSIZE];  /* array for storing packets waiting for ACK */
-static int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
-static int windowcount;                /* the number of packets currently awaiting an ACK */
-static int A_nextseqnum;               /* the next sequence number to be used by the sender */
+struct sender {
+  struct pkt buffer[WINDOWSIZE];  /* array for storing packets waiting for ACK */
+  int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
+  int windowcount;                /* the number of packets currently awaiting an ACK */
+  int A_nextseqnum;               /* the next sequence number to be used by the sender */
+  bool sacked[WINDOWSIZE];        /* buffer[i] is known to be buffered at B */
+  char fecxor[20];                /* FEC: XOR of the payloads of the group so far */
+  int fecfirst, fecn;             /* FEC: seqnum of the group's first packet, packets in it */
+  int feck;                       /* FEC: packets per group */
+  double fecloss;                 /* FEC_ADAPT: estimated loss rate */
+};
+
+static struct sender *senders;    /* one sender per flow, indexed by curflow */
+
+/* FEC_ADAPT: moving average, over new packets and timeouts, of whether
+   it was a timeout.  A timeout stands for one loss */
+static void fec_note(struct sender *s, int resend)
+{
+  s->fecloss = 0.95 * s->fecloss + 0.05 * resend;
+}
+
+/* FEC: add a new data packet to the group, and close the group with its
+   parity packet once it has feck of them */
+static void fec_add(struct sender *s, struct pkt *packet)
+{
+  struct pkt parity;
+  int i;
+
+  if (s->fecn == 0) {
+    s->fecfirst = packet->seqnum;
+    for (i=0; i<20; i++)
+      s->fecxor[i] = 0;
+  }
+  for (i=0; i<20; i++)
+    s->fecxor[i] ^= packet->payload[i];
+  if (FEC_ADAPT)
+    fec_note(s, 0);
+  if (++s->fecn < s->feck)
+    return;
+
+  parity.seqnum = s->fecfirst;
+  parity.acknum = PARITY(s->feck);
+  for (i=0; i<20; i++)
+    parity.payload[i] = s->fecxor[i];
+  parity.checksum = ComputeChecksum(parity);
+  if (TRACE > 0)
+    printf("Sending parity of packets %d to %d to layer 3\n",
+           s->fecfirst, (s->fecfirst + s->feck - 1) % SEQSPACE);
+  tolayer3(A, parity);
+  parity_sent++;
+  s->fecn = 0;
+
+  if (FEC_ADAPT) {
+    s->feck = s->fecloss > 0.0 ? (int)(0.5 / s->fecloss) - 1 : WINDOWSIZE;
+    if (s->feck < 2)
+      s->feck = 2;
+    if (s->feck > WINDOWSIZE)
+      s->feck = WINDOWSIZE;
+  }
+}
 
 /* called from layer 5 (application layer), passed the message to be sent to other side */
 void A_output(struct msg message)
 {
+  struct sender *s = &senders[curflow];
   struct pkt sendpkt;
   int i;
 
   /* if not blocked waiting on ACK */
-  if ( windowcount < WINDOWSIZE) {
+  if ( s->windowcount < WINDOWSIZE) {
     if (TRACE > 1)
       printf("----A: New message arrives, send window is not full, send new messge to layer3!\n");
 
     /* create packet */
-    sendpkt.seqnum = A_nextseqnum;
+    sendpkt.seqnum = s->A_nextseqnum;
     sendpkt.acknum = NOTINUSE;
     for ( i=0; i<20 ; i++ )
       sendpkt.payload[i] = message.data[i];
@@ -82,21 +176,25 @@ void A_output(struct msg message)
 
     /* put packet in window buffer */
     /* windowlast will always be 0 for alternating bit; but not for GoBackN */
-    windowlast = (windowlast + 1) % WINDOWSIZE;
-    buffer[windowlast] = sendpkt;
-    windowcount++;
+    s->windowlast = (s->windowlast + 1) % WINDOWSIZE;
+    s->buffer[s->windowlast] = sendpkt;
+    s->sacked[s->windowlast] = false;
+    s->windowcount++;
+    window_occupancy++;
 
     /* send out packet */
     if (TRACE > 0)
       printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
     tolayer3 (A, sendpkt);
+    if (FEC)
+      fec_add(s, &sendpkt);
 
     /* start timer if first packet in window */
-    if (windowcount == 1)
+    if (s->windowcount == 1)
       starttimer(A,RTT);
 
     /* get next sequence number, wrap back to 0 */
-    A_nextseqnum = (A_nextseqnum + 1) % SEQSPACE;
+    s->A_nextseqnum = (s->A_nextseqnum + 1) % SEQSPACE;
   }
   /* if blocked,  window is full */
   else {
@@ -112,6 +210,7 @@ void A_output(struct msg message)
 */
 void A_input(struct pkt packet)
 {
+  struct sender *s = &senders[curflow];
   int ackcount = 0;
   int i;
 
@@ -122,9 +221,9 @@ void A_input(struct pkt packet)
     total_ACKs_received++;
 
     /* check if new ACK or duplicate */
-    if (windowcount != 0) {
-          int seqfirst = buffer[windowfirst].seqnum;
-          int seqlast = buffer[windowlast].seqnum;
+    if (s->windowcount != 0) {
+          int seqfirst = s->buffer[s->windowfirst].seqnum;
+          int seqlast = s->buffer[s->windowlast].seqnum;
           /* check case when seqnum has and hasn't wrapped */
           if (((seqfirst <= seqlast) && (packet.acknum >= seqfirst && packet.acknum <= seqlast)) ||
               ((seqfirst > seqlast) && (packet.acknum >= seqfirst || packet.acknum <= seqlast))) {
@@ -138,18 +237,20 @@ void A_input(struct pkt packet)
             if (packet.acknum >= seqfirst)
               ackcount = packet.acknum + 1 - seqfirst;
             else
-              ackcount = SEQSPACE - seqfirst + packet.acknum;
-
-	    /* slide window by the number of packets ACKed */
-            windowfirst = (windowfirst + ackcount) % WINDOWSIZE;
+              ackcount = SEQSPACE - seqfirst + packet.acknum + 1;
 
-            /* delete the acked packets from window buffer */
-            for (i=0; i<ackcount; i++)
-              windowcount--;
+	    /* slide window by the number of packets ACKed, and delete them
+	       from the window buffer */
+            for (i=0; i<ackcount; i++) {
+              s->sacked[s->windowfirst] = false;
+              s->windowfirst = (s->windowfirst + 1) % WINDOWSIZE;
+              s->windowcount--;
+            }
+            window_occupancy -= ackcount;
 
 	    /* start timer again if there are still more unacked packets in window */
             stoptimer(A);
-            if (windowcount > 0)
+            if (s->windowcount > 0)
               starttimer(A, RTT);
 
           }
@@ -157,6 +258,15 @@ void A_input(struct pkt packet)
         else
           if (TRACE > 0)
         printf ("----A: duplicate ACK received, do nothing!\n");
+
+    /* note which of the remaining packets B already holds */
+    if (SACK)
+      for (i=0; i<s->windowcount; i++) {
+        int idx = (s->windowfirst + i) % WINDOWSIZE;
+        int offset = (s->buffer[idx].seqnum - packet.acknum - 1 + SEQSPACE) % SEQSPACE;
+        if (offset < WINDOWSIZE && packet.payload[offset] == '1')
+          s->sacked[idx] = true;
+      }
   }
   else
     if (TRACE > 0)
@@ -166,18 +276,24 @@ void A_input(struct pkt packet)
 /* called when A's timer goes off */
 void A_timerinterrupt(void)
 {
+  struct sender *s = &senders[curflow];
   int i;
 
   if (TRACE > 0)
     printf("----A: time out,resend packets!\n");
+  if (FEC_ADAPT)
+    fec_note(s, 1);
 
-  for(i=0; i<windowcount; i++) {
+  for(i=0; i<s->windowcount; i++) {
 
-    if (TRACE > 0)
-      printf ("---A: resending packet %d\n", (buffer[(windowfirst+i) % WINDOWSIZE]).seqnum);
+    /* with SACK, packets B already holds are not sent again */
+    if (!(SACK && s->sacked[(s->windowfirst+i) % WINDOWSIZE])) {
+      if (TRACE > 0)
+        printf ("---A: resending packet %d\n", (s->buffer[(s->windowfirst+i) % WINDOWSIZE]).seqnum);
 
-    tolayer3(A,buffer[(windowfirst+i) % WINDOWSIZE]);
-    packets_resent++;
+      tolayer3(A,s->buffer[(s->windowfirst+i) % WINDOWSIZE]);
+      packets_resent++;
+    }
     if (i==0) starttimer(A,RTT);
   }
 }
@@ -188,76 +304,229 @@ void A_timerinterrupt(void)
 /* entity A routines are called. You can use it to do any initialization */
 void A_init(void)
 {
-  /* initialise A's window, buffer and sequence number */
-  A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
-  windowfirst = 0;
-  windowlast = -1;   /* windowlast is where the last packet sent is stored.
+  int f;
+
+  senders = malloc(nflows * sizeof(struct sender));
+  if (senders == NULL) {
+    printf("memory allocation for senders failed.");
+    exit(EXIT_FAILURE);
+  }
+
+  /* initialise A's window, buffer and sequence number for every flow */
+  for (f=0; f<nflows; f++) {
+    senders[f].A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
+    senders[f].windowfirst = 0;
+    senders[f].windowlast = -1;   /* windowlast is where the last packet sent is stored.
 		     new packets are placed in winlast + 1
 		     so initially this is set to -1
 		   */
-  windowcount = 0;
+    senders[f].windowcount = 0;
+    senders[f].fecn = 0;
+    senders[f].feck = FEC;
+    senders[f].fecloss = 0.0;
+  }
 }
 
 
 
 /********* Receiver (B)  variables and procedures ************/
 
-static int expectedseqnum; /* the sequence number expected next by the receiver */
-static int B_nextseqnum;   /* the sequence number for the next packets sent by B */
+/* ACK policy of the receiver: ACK every ACK_EVERY-th in order packet, or
+   ACK_DELAY time units after the first unacknowledged one, whichever comes
+   first (B's timer is used for the delay).  Packets that are corrupted, out
+   of order or duplicates are ACKed at once.  ACK_EVERY 1 ACKs every packet */
+#ifndef ACK_EVERY
+#define ACK_EVERY 1
+#endif
+#ifndef ACK_DELAY
+#define ACK_DELAY 4.0
+#endif
+
+struct receiver {
+  int expectedseqnum; /* the sequence number expected next by the receiver */
+  int B_nextseqnum;   /* the sequence number for the next packets sent by B */
+  struct pkt rcvbuffer[WINDOWSIZE]; /* SACK, FEC: out of order packets, indexed by seqnum % WINDOWSIZE */
+  bool rcvd[WINDOWSIZE];            /* SACK, FEC: rcvbuffer slot is in use */
+  char fecdata[SEQSPACE][20];       /* FEC: payloads delivered, by seqnum */
+  int unacked;        /* in order packets received since the last ACK */
+  bool acktimer;      /* B's timer is running for a delayed ACK */
+};
+
+static struct receiver *receivers;  /* one receiver per flow, indexed by curflow */
+
+
+/* send a cumulative ACK for the last in order packet */
+static void B_sendack(struct receiver *r)
+{
+  struct pkt sendpkt;
+  int i;
 
+  if (r->acktimer) {
+    stoptimer(B);
+    r->acktimer = false;
+  }
+  r->unacked = 0;
+
+  if (r->expectedseqnum == 0)
+    sendpkt.acknum = SEQSPACE - 1;
+  else
+    sendpkt.acknum = r->expectedseqnum - 1;
+
+  /* create packet */
+  sendpkt.seqnum = r->B_nextseqnum;
+  r->B_nextseqnum = (r->B_nextseqnum + 1) % 2;
+
+  /* we don't have any data to send.  fill payload with 0's, or with the
+     receive bitmap when using SACK */
+  for ( i=0; i<20 ; i++ )
+    sendpkt.payload[i] = '0';
+  if (SACK)
+    for ( i=0; i<WINDOWSIZE ; i++ )
+      if (r->rcvd[(sendpkt.acknum + 1 + i) % SEQSPACE % WINDOWSIZE])
+        sendpkt.payload[i] = '1';
+
+  /* computer checksum */
+  sendpkt.checksum = ComputeChecksum(sendpkt);
+
+  /* send out packet */
+  tolayer3 (B, sendpkt);
+}
+
+/* deliver a payload to layer 5, and keep it for FEC */
+static void B_deliver(struct receiver *r, int seqnum, char payload[20])
+{
+  int i;
+
+  tolayer5(B, payload);
+  if (FEC)
+    for (i=0; i<20; i++)
+      r->fecdata[seqnum][i] = payload[i];
+}
+
+/* FEC: a parity packet has arrived.  If exactly one packet of its group
+   is missing, rebuild it and take it as if it had come from A */
+static void B_parity(struct receiver *r, struct pkt parity)
+{
+  struct pkt rebuilt;
+  char *data;
+  int k = PARITY(0) - parity.acknum;  /* parity.acknum is PARITY(k) */
+  int missing = -1;
+  int i, j, seq, offset;
+
+  if (k > WINDOWSIZE)
+    return;
+
+  for (i=0; i<20; i++)
+    rebuilt.payload[i] = parity.payload[i];
+  for (j=0; j<k; j++) {
+    seq = (parity.seqnum + j) % SEQSPACE;
+    offset = (seq - r->expectedseqnum + SEQSPACE) % SEQSPACE;
+    if (offset >= WINDOWSIZE)               /* delivered */
+      data = r->fecdata[seq];
+    else if (r->rcvd[seq % WINDOWSIZE])     /* buffered */
+      data = r->rcvbuffer[seq % WINDOWSIZE].payload;
+    else if (missing < 0) {
+      missing = seq;
+      continue;
+    }
+    else {
+      if (TRACE > 0)
+        printf("----B: parity of packets %d to %d is no use, two are missing\n",
+               parity.seqnum, (parity.seqnum + k - 1) % SEQSPACE);
+      return;
+    }
+    for (i=0; i<20; i++)
+      rebuilt.payload[i] ^= data[i];
+  }
+  if (missing < 0)
+    return;                                 /* nothing was lost */
+
+  if (TRACE > 0)
+    printf("----B: packet %d rebuilt from parity\n", missing);
+  fec_recovered++;
+  rebuilt.seqnum = missing;
+  rebuilt.acknum = NOTINUSE;
+  rebuilt.checksum = ComputeChecksum(rebuilt);
+  B_input(rebuilt);
+}
 
 /* called from layer 3, when a packet arrives for layer 4 at B*/
 void B_input(struct pkt packet)
 {
-  struct pkt sendpkt;
-  int i;
+  struct receiver *r = &receivers[curflow];
+  int offset;
+
+  if (FEC && packet.acknum <= PARITY(1) && !IsCorrupted(packet)) {
+    B_parity(r, packet);
+    return;
+  }
 
   /* if not corrupted and received packet is in order */
-  if  ( (!IsCorrupted(packet))  && (packet.seqnum == expectedseqnum) ) {
+  if  ( (!IsCorrupted(packet))  && (packet.seqnum == r->expectedseqnum) ) {
     if (TRACE > 0)
       printf("----B: packet %d is correctly received, send ACK!\n",packet.seqnum);
     packets_received++;
 
     /* deliver to receiving application */
-    tolayer5(B, packet.payload);
-
-    /* send an ACK for the received packet */
-    sendpkt.acknum = expectedseqnum;
+    B_deliver(r, packet.seqnum, packet.payload);
 
     /* update state variables */
-    expectedseqnum = (expectedseqnum + 1) % SEQSPACE;
+    r->expectedseqnum = (r->expectedseqnum + 1) % SEQSPACE;
+
+    /* SACK, FEC: deliver any buffered packets that are now in order */
+    while (BUFFERED && r->rcvd[r->expectedseqnum % WINDOWSIZE]) {
+      B_deliver(r, r->expectedseqnum, r->rcvbuffer[r->expectedseqnum % WINDOWSIZE].payload);
+      r->rcvd[r->expectedseqnum % WINDOWSIZE] = false;
+      receiver_buffered--;
+      r->expectedseqnum = (r->expectedseqnum + 1) % SEQSPACE;
+    }
+
+    /* send an ACK for the received packet, unless it can wait */
+    r->unacked++;
+    if (r->unacked >= ACK_EVERY)
+      B_sendack(r);
+    else if (!r->acktimer) {
+      starttimer(B, ACK_DELAY);
+      r->acktimer = true;
+    }
   }
   else {
+    /* SACK, FEC: keep a packet that arrived ahead of a hole */
+    offset = (packet.seqnum - r->expectedseqnum + SEQSPACE) % SEQSPACE;
+    if (BUFFERED && !IsCorrupted(packet) && offset < WINDOWSIZE && !r->rcvd[packet.seqnum % WINDOWSIZE]) {
+      if (TRACE > 0)
+        printf("----B: packet %d is out of order, buffer it and send SACK!\n",packet.seqnum);
+      packets_received++;
+      r->rcvbuffer[packet.seqnum % WINDOWSIZE] = packet;
+      r->rcvd[packet.seqnum % WINDOWSIZE] = true;
+      receiver_buffered++;
+    }
     /* packet is corrupted or out of order resend last ACK */
-    if (TRACE > 0)
+    else if (TRACE > 0)
       printf("----B: packet corrupted or not expected sequence number, resend ACK!\n");
-    if (expectedseqnum == 0)
-      sendpkt.acknum = SEQSPACE - 1;
-    else
-      sendpkt.acknum = expectedseqnum - 1;
+    B_sendack(r);
   }
-
-  /* create packet */
-  sendpkt.seqnum = B_nextseqnum;
-  B_nextseqnum = (B_nextseqnum + 1) % 2;
-
-  /* we don't have any data to send.  fill payload with 0's */
-  for ( i=0; i<20 ; i++ )
-    sendpkt.payload[i] = '0';
-
-  /* computer checksum */
-  sendpkt.checksum = ComputeChecksum(sendpkt);
-
-  /* send out packet */
-  tolayer3 (B, sendpkt);
 }
 
 /* the following routine will be called once (only) before any other */
 /* entity B routines are called. You can use it to do any initialization */
 void B_init(void)
 {
-  expectedseqnum = 0;
-  B_nextseqnum = 1;
+  int f, i;
+
+  receivers = malloc(nflows * sizeof(struct receiver));
+  if (receivers == NULL) {
+    printf("memory allocation for receivers failed.");
+    exit(EXIT_FAILURE);
+  }
+  for (f=0; f<nflows; f++) {
+    receivers[f].expectedseqnum = 0;
+    receivers[f].B_nextseqnum = 1;
+    receivers[f].unacked = 0;
+    receivers[f].acktimer = false;
+    for (i=0; i<WINDOWSIZE; i++)
+      receivers[f].rcvd[i] = false;
+  }
 }
 
 /******************************************************************************
@@ -269,7 +538,13 @@ void B_output(struct msg message)
 {
 }
 
-/* called when B's timer goes off */
+/* called when B's timer goes off: the delayed ACK is due */
 void B_timerinterrupt(void)
 {
+  struct receiver *r = &receivers[curflow];
+
+  if (TRACE > 0)
+    printf("----B: delayed ACK timer expired, send ACK!\n");
+  r->acktimer = false;
+  B_sendack(r);
 }
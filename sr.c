@@ -7,23 +7,85 @@
 #define SEQ_NUM_MODULO 12
 #define RTT 16.0
 
-/* Sender state */
-static int sender_base = 0;
-static int sender_next_seq_num = 0;
-static struct pkt sender_window[WINDOW_SIZE];
-static int acked[WINDOW_SIZE]; /* 1=ACKed, 0=not ACKed */
-
-/* Receiver state */
-static int receiver_expected_seq_num = 0;
-static struct pkt receiver_buffer[WINDOW_SIZE];
-static int received[WINDOW_SIZE]; /* 1=received, 0=not received */
-
-/* Statistics */
-int total_ACKs_received = 0;
-int packets_resent = 0;
-int new_ACKs = 0;
-int packets_received = 0;
-int window_full = 0;
+/* With SACK set, every ACK carries the cumulative ACK (last in-order packet)
+   in acknum and a receive bitmap in its payload: payload[i] is 1 if packet
+   acknum+1+i is buffered at B.  Build with -DSACK=1 to enable. */
+#ifndef SACK
+#define SACK 0
+#endif
+
+/* Receiver ACK policy: ACK every ACK_EVERY-th packet that advances the
+   window, or ACK_DELAY time units after the first one (on B's timer).
+   Out of order, duplicate and corrupted packets are ACKed at once.
+   Coalescing needs cumulative ACKs, so ACK_EVERY > 1 requires SACK. */
+#ifndef ACK_EVERY
+#define ACK_EVERY 1
+#endif
+#ifndef ACK_DELAY
+#define ACK_DELAY 4.0
+#endif
+#if ACK_EVERY > 1 && !SACK
+#error "delayed ACKs in SR need cumulative ACKs, build with -DSACK=1"
+#endif
+
+/* FEC: after every k new data packets A sends a parity packet, with the
+   seqnum of the first of them, acknum PARITY(k) and the XOR of their
+   payloads; resends are not part of any group.  Packets stay in order on
+   the channel, so when the parity reaches B the rest of its group has
+   arrived or been lost, and if just one is missing B rebuilds it from the
+   others, buffered or kept after delivery.  With FEC_ADAPT, k is the
+   largest that expects at most half a lost packet per group of k+1, but
+   at least 2.  Build with -DFEC=k, and -DFEC_ADAPT=1 to adapt from k. */
+#ifndef FEC
+#define FEC 0
+#endif
+#ifndef FEC_ADAPT
+#define FEC_ADAPT 0
+#endif
+#if FEC < 0 || FEC > WINDOW_SIZE || (FEC_ADAPT && !FEC)
+#error "FEC must be between 1 and WINDOW_SIZE, and FEC_ADAPT needs it as the starting k"
+#endif
+
+/* NAK: when a packet arrives ahead of a hole, B also sends a NAK, with
+   seqnum -1, acknum NAK_ACKNUM and payload[i] set to 1 if packet i is
+   missing, and A resends those packets at once instead of waiting for its
+   timer.  To avoid NAK storms B names a packet again only after
+   NAK_HOLDOFF time units.  Build with -DNAK=1 to enable.  B measures the
+   time from seeing a hole to filling it with or without NAKs. */
+#ifndef NAK
+#define NAK 0
+#endif
+#ifndef NAK_HOLDOFF
+#define NAK_HOLDOFF RTT
+#endif
+#define NAK_ACKNUM (-2)
+#define NOT_SEEN (-1)
+
+/* Sender state, one per flow */
+struct sender_state {
+    int sender_base;
+    int sender_next_seq_num;
+    struct pkt sender_window[WINDOW_SIZE];
+    int acked[WINDOW_SIZE]; /* 1=ACKed, 0=not ACKed */
+    char fec_xor[20];       /* FEC: XOR of the payloads of the group so far */
+    int fec_first, fec_n;   /* FEC: seqnum of the group's first packet, packets in it */
+    int fec_k;              /* FEC: packets per group */
+    double fec_loss;        /* FEC_ADAPT: moving share of timeouts among new packets and timeouts */
+};
+static struct sender_state *senders;
+
+/* Receiver state, one per flow */
+struct receiver_state {
+    int receiver_expected_seq_num;
+    struct pkt receiver_buffer[WINDOW_SIZE];
+    int received[WINDOW_SIZE]; /* 1=received, 0=not received */
+    int unacked;               /* in order packets since the last ACK */
+    int ack_timer;             /* 1=B's timer is running for a delayed ACK */
+    char fec_data[SEQ_NUM_MODULO][20]; /* FEC: payloads delivered, by seqnum */
+    simtime_t hole_seen[SEQ_NUM_MODULO]; /* when packet i was found missing, or NOT_SEEN */
+    simtime_t nak_at[SEQ_NUM_MODULO];    /* NAK: when packet i was last named in a NAK */
+};
+static struct receiver_state *receivers;
 
 /* Helper Functions */
 int calculate_checksum(struct pkt packet) {
@@ -49,6 +111,55 @@ void send_ack(int entity, int acknum) {
 
 }
 
+/* ACK the last in-order packet and report the buffered ones after it */
+void send_sack(struct receiver_state *r) {
+    struct pkt ack_pkt;
+    int acknum = (r->receiver_expected_seq_num - 1 + SEQ_NUM_MODULO) % SEQ_NUM_MODULO;
+    if (r->ack_timer) {
+        stoptimer(B);
+        r->ack_timer = 0;
+    }
+    r->unacked = 0;
+    memset(ack_pkt.payload, 0, 20);
+    for (int i = 0; i < WINDOW_SIZE; i++) {
+        int seq = (acknum + 1 + i) % SEQ_NUM_MODULO;
+        ack_pkt.payload[i] = r->received[seq % WINDOW_SIZE] &&
+                             r->receiver_buffer[seq % WINDOW_SIZE].seqnum == seq;
+    }
+    ack_pkt.seqnum = -1;
+    ack_pkt.acknum = acknum;
+    ack_pkt.checksum = calculate_checksum(ack_pkt);
+    tolayer3(B, ack_pkt);
+}
+
+/* NAK the holes before seqnum that have not been named lately */
+static void send_nak(struct receiver_state *r, int seqnum) {
+    struct pkt nak_pkt;
+    simtime_t now = get_sim_ticks();
+    int named = 0;
+
+    memset(nak_pkt.payload, 0, 20);
+    for (int seq = r->receiver_expected_seq_num; seq != seqnum; seq = (seq + 1) % SEQ_NUM_MODULO) {
+        if (!r->received[seq % WINDOW_SIZE] &&
+            (r->nak_at[seq] == NOT_SEEN || now - r->nak_at[seq] >= UNITS_TO_TICKS(NAK_HOLDOFF))) {
+            nak_pkt.payload[seq] = 1;
+            r->nak_at[seq] = now;
+            named++;
+        }
+    }
+    if (named == 0) {
+        return;
+    }
+    if (TRACE > 1) {
+        printf("NAK for %d missing packets before %d\n", named, seqnum);
+    }
+    nak_pkt.seqnum = -1;
+    nak_pkt.acknum = NAK_ACKNUM;
+    nak_pkt.checksum = calculate_checksum(nak_pkt);
+    tolayer3(B, nak_pkt);
+    naks_sent++;
+}
+
 void send_packet(int entity, struct pkt packet) {
     if (TRACE > 2) {
         printf("Entity %d sending packet seqnum=%d\n", entity, packet.seqnum);
@@ -56,43 +167,122 @@ void send_packet(int entity, struct pkt packet) {
     tolayer3(entity, packet);
 }
 
+/* FEC_ADAPT: a timeout stands for one loss */
+static void fec_note(struct sender_state *s, int timeout) {
+    s->fec_loss = 0.95 * s->fec_loss + 0.05 * timeout;
+}
+
+/* FEC: add a new data packet to the group, and close the group with its
+   parity packet once it has fec_k of them */
+static void fec_add(struct sender_state *s, struct pkt *packet) {
+    struct pkt parity;
+
+    if (s->fec_n == 0) {
+        s->fec_first = packet->seqnum;
+        memset(s->fec_xor, 0, 20);
+    }
+    for (int i = 0; i < 20; i++) {
+        s->fec_xor[i] ^= packet->payload[i];
+    }
+    if (FEC_ADAPT) {
+        fec_note(s, 0);
+    }
+    if (++s->fec_n < s->fec_k) {
+        return;
+    }
+
+    parity.seqnum = s->fec_first;
+    parity.acknum = PARITY(s->fec_k);
+    memcpy(parity.payload, s->fec_xor, 20);
+    parity.checksum = calculate_checksum(parity);
+    if (TRACE > 2) {
+        printf("Entity %d sending parity of packets %d to %d\n", A,
+               s->fec_first, (s->fec_first + s->fec_k - 1) % SEQ_NUM_MODULO);
+    }
+    tolayer3(A, parity);
+    parity_sent++;
+    s->fec_n = 0;
+
+    if (FEC_ADAPT) {
+        s->fec_k = s->fec_loss > 0.0 ? (int)(0.5 / s->fec_loss) - 1 : WINDOW_SIZE;
+        if (s->fec_k < 2) {
+            s->fec_k = 2;
+        }
+        if (s->fec_k > WINDOW_SIZE) {
+            s->fec_k = WINDOW_SIZE;
+        }
+    }
+}
+
 /* Sender Implementation */
 void A_init(void) {
-    sender_base = 0;
-    sender_next_seq_num = 0;
-    memset(acked, 0, sizeof(acked));
+    senders = calloc(nflows, sizeof(struct sender_state));
+    if (senders == NULL) {
+        printf("memory allocation for senders failed.");
+        exit(EXIT_FAILURE);
+    }
+    for (int f = 0; f < nflows; f++) {
+        senders[f].sender_base = 0;
+        senders[f].sender_next_seq_num = 0;
+        memset(senders[f].acked, 0, sizeof(senders[f].acked));
+        senders[f].fec_n = 0;
+        senders[f].fec_k = FEC;
+        senders[f].fec_loss = 0.0;
+    }
 }
 
 void A_output(struct msg message) {
+    struct sender_state *s = &senders[curflow];
+
     /* Check if window is full */
-    if ((sender_next_seq_num - sender_base) % SEQ_NUM_MODULO >= WINDOW_SIZE) {
+    if ((s->sender_next_seq_num - s->sender_base + SEQ_NUM_MODULO) % SEQ_NUM_MODULO >= WINDOW_SIZE) {
         if (TRACE > 0) {
             printf("Window full (base=%d, next=%d). Message dropped.\n", 
-                  sender_base, sender_next_seq_num);
+                  s->sender_base, s->sender_next_seq_num);
         }
         window_full++;
         return;
     }
 
     /* Create and store packet */
-    int window_index = sender_next_seq_num % WINDOW_SIZE;
-    sender_window[window_index].seqnum = sender_next_seq_num;
-    sender_window[window_index].acknum = -1;
-    strncpy(sender_window[window_index].payload, message.data, 20);
-    sender_window[window_index].checksum = calculate_checksum(sender_window[window_index]);
-
-    acked[window_index] = 0;
-    send_packet(A, sender_window[window_index]);
+    int window_index = s->sender_next_seq_num % WINDOW_SIZE;
+    s->sender_window[window_index].seqnum = s->sender_next_seq_num;
+    s->sender_window[window_index].acknum = -1;
+    memcpy(s->sender_window[window_index].payload, message.data, 20);
+    s->sender_window[window_index].checksum = calculate_checksum(s->sender_window[window_index]);
+
+    s->acked[window_index] = 0;
+    send_packet(A, s->sender_window[window_index]);
+    if (FEC) {
+        fec_add(s, &s->sender_window[window_index]);
+    }
 
     /* Start timer if first packet in window */
-    if (sender_base == sender_next_seq_num) {
+    if (s->sender_base == s->sender_next_seq_num) {
         starttimer(A, RTT);
     }
 
-    sender_next_seq_num = (sender_next_seq_num + 1) % SEQ_NUM_MODULO;
+    s->sender_next_seq_num = (s->sender_next_seq_num + 1) % SEQ_NUM_MODULO;
+    window_occupancy++;
+}
+
+/* mark seqnum ACKed if it is in flight; returns 1 if it was not already */
+static int mark_acked(struct sender_state *s, int seqnum) {
+    int in_flight = (s->sender_next_seq_num - s->sender_base + SEQ_NUM_MODULO) % SEQ_NUM_MODULO;
+
+    if (seqnum < 0 || seqnum >= SEQ_NUM_MODULO ||
+        (seqnum - s->sender_base + SEQ_NUM_MODULO) % SEQ_NUM_MODULO >= in_flight ||
+        s->acked[seqnum % WINDOW_SIZE]) {
+        return 0;
+    }
+    s->acked[seqnum % WINDOW_SIZE] = 1;
+    return 1;
 }
 
 void A_input(struct pkt packet) {
+    struct sender_state *s = &senders[curflow];
+    int newly_acked = 0;
+
     if (is_corrupted(packet)) {
         if (TRACE > 0) {
             printf("Corrupted ACK received. Ignoring.\n");
@@ -100,107 +290,275 @@ void A_input(struct pkt packet) {
         return;
     }
 
+    if (NAK && packet.acknum == NAK_ACKNUM) {
+        /* resend the packets B names that are still unACKed */
+        int in_flight = (s->sender_next_seq_num - s->sender_base + SEQ_NUM_MODULO) % SEQ_NUM_MODULO;
+        for (int i = 0; i < in_flight; i++) {
+            int seq = (s->sender_base + i) % SEQ_NUM_MODULO;
+            if (packet.payload[seq] && !s->acked[seq % WINDOW_SIZE]) {
+                if (TRACE > 1) {
+                    printf("NAK for %d received. Resending it\n", seq);
+                }
+                send_packet(A, s->sender_window[seq % WINDOW_SIZE]);
+                packets_resent++;
+            }
+        }
+        return;
+    }
+
     total_ACKs_received++;
     int acknum = packet.acknum;
-    int window_index = acknum % WINDOW_SIZE;
-
-    /* Check if ACK is within current window */
-    if ((acknum - sender_base) % SEQ_NUM_MODULO < WINDOW_SIZE) {
-        if (!acked[window_index]) {
-            acked[window_index] = 1;
-            new_ACKs++;
 
-            if (TRACE > 1) {
-                printf("ACK %d received. Window before: base=%d\n", acknum, sender_base);
+    if (SACK) {
+        /* cumulative part: everything from the base up to acknum */
+        int covered = (acknum - s->sender_base + 1 + SEQ_NUM_MODULO) % SEQ_NUM_MODULO;
+        if (covered <= (s->sender_next_seq_num - s->sender_base + SEQ_NUM_MODULO) % SEQ_NUM_MODULO) {
+            for (int i = 0; i < covered; i++) {
+                newly_acked += mark_acked(s, (s->sender_base + i) % SEQ_NUM_MODULO);
             }
-
-            /* Slide window forward continuously */
-            while (acked[sender_base % WINDOW_SIZE] && sender_base != sender_next_seq_num) {
-                acked[sender_base % WINDOW_SIZE] = 0;
-                sender_base = (sender_base + 1) % SEQ_NUM_MODULO;
+        }
+        /* selective part: packets buffered beyond the hole */
+        for (int i = 0; i < WINDOW_SIZE; i++) {
+            if (packet.payload[i]) {
+                newly_acked += mark_acked(s, (acknum + 1 + i) % SEQ_NUM_MODULO);
             }
+        }
+    } else {
+        newly_acked = mark_acked(s, acknum);
+    }
 
-            if (TRACE > 1) {
-                printf("Window after: base=%d, next=%d\n", sender_base, sender_next_seq_num);
-            }
+    if (newly_acked) {
+        new_ACKs++;
 
-            /* Restart timer only if unACKed packets remain */
-            stoptimer(A);
-            if (sender_base != sender_next_seq_num) {
-                starttimer(A, RTT);
-            }
+        if (TRACE > 1) {
+            printf("ACK %d received. Window before: base=%d\n", acknum, s->sender_base);
+        }
+
+        /* Slide window forward continuously */
+        while (s->acked[s->sender_base % WINDOW_SIZE] && s->sender_base != s->sender_next_seq_num) {
+            s->acked[s->sender_base % WINDOW_SIZE] = 0;
+            s->sender_base = (s->sender_base + 1) % SEQ_NUM_MODULO;
+            window_occupancy--;
+        }
+
+        if (TRACE > 1) {
+            printf("Window after: base=%d, next=%d\n", s->sender_base, s->sender_next_seq_num);
+        }
+
+        /* Restart timer only if unACKed packets remain */
+        stoptimer(A);
+        if (s->sender_base != s->sender_next_seq_num) {
+            starttimer(A, RTT);
         }
     }
 }
 
 void A_timerinterrupt(void) {
+    struct sender_state *s = &senders[curflow];
+
     if (TRACE > 0) {
         printf("Timeout occurred. Resending unACKed packets in window %d-%d\n",
-              sender_base, (sender_base + WINDOW_SIZE - 1) % SEQ_NUM_MODULO);
+              s->sender_base, (s->sender_base + WINDOW_SIZE - 1) % SEQ_NUM_MODULO);
+    }
+    if (FEC_ADAPT) {
+        fec_note(s, 1);
     }
 
     /* Resend all unACKed packets in window */
-    for (int i = sender_base; i != sender_next_seq_num; i = (i + 1) % SEQ_NUM_MODULO) {
-        if (!acked[i % WINDOW_SIZE]) {
-            send_packet(A, sender_window[i % WINDOW_SIZE]);
+    for (int i = s->sender_base; i != s->sender_next_seq_num; i = (i + 1) % SEQ_NUM_MODULO) {
+        if (!s->acked[i % WINDOW_SIZE]) {
+            send_packet(A, s->sender_window[i % WINDOW_SIZE]);
             packets_resent++;
         }
     }
-    starttimer(A, RTT);
+    if (s->sender_base != s->sender_next_seq_num) {
+        starttimer(A, RTT);
+    }
 }
 
 /* Receiver Implementation */
 void B_init(void) {
-    receiver_expected_seq_num = 0;
-    memset(received, 0, sizeof(received));
+    receivers = calloc(nflows, sizeof(struct receiver_state));
+    if (receivers == NULL) {
+        printf("memory allocation for receivers failed.");
+        exit(EXIT_FAILURE);
+    }
+    for (int f = 0; f < nflows; f++) {
+        receivers[f].receiver_expected_seq_num = 0;
+        receivers[f].unacked = 0;
+        receivers[f].ack_timer = 0;
+        memset(receivers[f].received, 0, sizeof(receivers[f].received));
+        for (int i = 0; i < SEQ_NUM_MODULO; i++) {
+            receivers[f].hole_seen[i] = NOT_SEEN;
+            receivers[f].nak_at[i] = NOT_SEEN;
+        }
+    }
+}
+
+void B_input(struct pkt packet);
+
+/* FEC: a parity packet has arrived.  If exactly one packet of its group
+   is missing, rebuild it and take it as if it had come from A */
+static void B_parity(struct receiver_state *r, struct pkt parity) {
+    struct pkt rebuilt;
+    int k = PARITY(0) - parity.acknum; /* parity.acknum is PARITY(k) */
+    int missing = -1;
+
+    if (k > WINDOW_SIZE) {
+        return;
+    }
+    memcpy(rebuilt.payload, parity.payload, 20);
+    for (int j = 0; j < k; j++) {
+        int seq = (parity.seqnum + j) % SEQ_NUM_MODULO;
+        int offset = (seq - r->receiver_expected_seq_num + SEQ_NUM_MODULO) % SEQ_NUM_MODULO;
+        char *data;
+
+        if (offset >= WINDOW_SIZE) {
+            data = r->fec_data[seq];
+        } else if (r->received[seq % WINDOW_SIZE] &&
+                   r->receiver_buffer[seq % WINDOW_SIZE].seqnum == seq) {
+            data = r->receiver_buffer[seq % WINDOW_SIZE].payload;
+        } else if (missing < 0) {
+            missing = seq;
+            continue;
+        } else {
+            if (TRACE > 0) {
+                printf("Parity of packets %d to %d is no use, two are missing\n",
+                       parity.seqnum, (parity.seqnum + k - 1) % SEQ_NUM_MODULO);
+            }
+            return;
+        }
+        for (int i = 0; i < 20; i++) {
+            rebuilt.payload[i] ^= data[i];
+        }
+    }
+    if (missing < 0) {
+        return; /* nothing was lost */
+    }
+
+    if (TRACE > 0) {
+        printf("Packet %d rebuilt from parity\n", missing);
+    }
+    fec_recovered++;
+    rebuilt.seqnum = missing;
+    rebuilt.acknum = -1;
+    rebuilt.checksum = calculate_checksum(rebuilt);
+    B_input(rebuilt);
 }
 
 void B_input(struct pkt packet) {
+    struct receiver_state *r = &receivers[curflow];
+
     if (is_corrupted(packet)) {
         if (TRACE > 0) {
             printf("Corrupted packet received. Sending ACK for last good packet %d\n",
-                 (receiver_expected_seq_num - 1 + SEQ_NUM_MODULO) % SEQ_NUM_MODULO);
+                 (r->receiver_expected_seq_num - 1 + SEQ_NUM_MODULO) % SEQ_NUM_MODULO);
+        }
+        if (SACK) {
+            send_sack(r);
+        } else {
+            send_ack(B, (r->receiver_expected_seq_num - 1 + SEQ_NUM_MODULO) % SEQ_NUM_MODULO);
         }
-        send_ack(B, (receiver_expected_seq_num - 1 + SEQ_NUM_MODULO) % SEQ_NUM_MODULO);
+        return;
+    }
+    if (FEC && packet.acknum <= PARITY(1)) {
+        B_parity(r, packet);
         return;
     }
     int seqnum = packet.seqnum;
-    int window_start = receiver_expected_seq_num;
-    int window_end = (receiver_expected_seq_num + WINDOW_SIZE - 1) % SEQ_NUM_MODULO;
+    int window_start = r->receiver_expected_seq_num;
+    int window_end = (r->receiver_expected_seq_num + WINDOW_SIZE - 1) % SEQ_NUM_MODULO;
+    int offset = (seqnum - window_start + SEQ_NUM_MODULO) % SEQ_NUM_MODULO;
 
     if (TRACE > 1) {
         printf("Received packet %d (expected %d, window %d-%d)\n",
-              seqnum, receiver_expected_seq_num, window_start, window_end);
+              seqnum, r->receiver_expected_seq_num, window_start, window_end);
     }
 
     /* Check if packet is in window */
-    if ((window_start <= window_end && seqnum >= window_start && seqnum <= window_end) ||
-        (window_start > window_end && (seqnum >= window_start || seqnum <= window_end))) {
+    if (offset < WINDOW_SIZE) {
         
-        if (!received[seqnum % WINDOW_SIZE]) {
-            receiver_buffer[seqnum % WINDOW_SIZE] = packet;
-            received[seqnum % WINDOW_SIZE] = 1;
+        if (!r->received[seqnum % WINDOW_SIZE]) {
+            r->receiver_buffer[seqnum % WINDOW_SIZE] = packet;
+            r->received[seqnum % WINDOW_SIZE] = 1;
+            receiver_buffered++;
             packets_received++;
-        }
 
-        send_ack(B, seqnum);
+            /* time how long each hole lasts, from the first packet seen beyond it */
+            simtime_t now = get_sim_ticks();
+            if (r->hole_seen[seqnum] != NOT_SEEN) {
+                gaps_filled++;
+                gap_time += TICKS_TO_UNITS(now - r->hole_seen[seqnum]);
+                r->hole_seen[seqnum] = NOT_SEEN;
+            }
+            r->nak_at[seqnum] = NOT_SEEN;
+            for (int seq = window_start; seq != seqnum; seq = (seq + 1) % SEQ_NUM_MODULO) {
+                if (!r->received[seq % WINDOW_SIZE] && r->hole_seen[seq] == NOT_SEEN) {
+                    r->hole_seen[seq] = now;
+                }
+            }
+            if (NAK && offset > 0) {
+                send_nak(r, seqnum);
+            }
+        }
 
         /* Deliver in-order packets */
-        while (received[receiver_expected_seq_num % WINDOW_SIZE] && 
-               receiver_buffer[receiver_expected_seq_num % WINDOW_SIZE].seqnum == receiver_expected_seq_num) {
-            tolayer5(B, receiver_buffer[receiver_expected_seq_num % WINDOW_SIZE].payload);
-            received[receiver_expected_seq_num % WINDOW_SIZE] = 0;
-            receiver_expected_seq_num = (receiver_expected_seq_num + 1) % SEQ_NUM_MODULO;
+        while (r->received[r->receiver_expected_seq_num % WINDOW_SIZE] && 
+               r->receiver_buffer[r->receiver_expected_seq_num % WINDOW_SIZE].seqnum == r->receiver_expected_seq_num) {
+            tolayer5(B, r->receiver_buffer[r->receiver_expected_seq_num % WINDOW_SIZE].payload);
+            if (FEC) {
+                memcpy(r->fec_data[r->receiver_expected_seq_num],
+                       r->receiver_buffer[r->receiver_expected_seq_num % WINDOW_SIZE].payload, 20);
+            }
+            r->received[r->receiver_expected_seq_num % WINDOW_SIZE] = 0;
+            receiver_buffered--;
+            r->receiver_expected_seq_num = (r->receiver_expected_seq_num + 1) % SEQ_NUM_MODULO;
+        }
+
+        if (SACK && offset == 0 && ++r->unacked < ACK_EVERY) {
+            /* in order: the ACK can wait for more packets or the timer */
+            if (!r->ack_timer) {
+                starttimer(B, ACK_DELAY);
+                r->ack_timer = 1;
+            }
+        } else if (SACK) {
+            send_sack(r);
+        } else {
+            send_ack(B, seqnum);
+        }
+    } else if (offset >= SEQ_NUM_MODULO - WINDOW_SIZE) {
+        /* already delivered: the ACK for it was lost, so send it again */
+        if (TRACE > 0) {
+            printf("Duplicate packet %d received. Sending ACK again\n", seqnum);
+        }
+        if (SACK) {
+            send_sack(r);
+        } else {
+            send_ack(B, seqnum);
         }
     } else {
         if (TRACE > 0) {
             printf("Out-of-window packet %d received. Sending ACK for %d\n",
-                 seqnum, (receiver_expected_seq_num - 1 + SEQ_NUM_MODULO) % SEQ_NUM_MODULO);
+                 seqnum, (r->receiver_expected_seq_num - 1 + SEQ_NUM_MODULO) % SEQ_NUM_MODULO);
         }
-        send_ack(B, (receiver_expected_seq_num - 1 + SEQ_NUM_MODULO) % SEQ_NUM_MODULO);
+        if (SACK) {
+            send_sack(r);
+        } else {
+            send_ack(B, (r->receiver_expected_seq_num - 1 + SEQ_NUM_MODULO) % SEQ_NUM_MODULO);
+        }
+    }
+}
+
+/* Delayed ACK is due */
+void B_timerinterrupt(void) {
+    struct receiver_state *r = &receivers[curflow];
+
+    if (TRACE > 0) {
+        printf("Delayed ACK timer expired. Sending ACK\n");
     }
+    r->ack_timer = 0;
+    send_sack(r);
 }
 
 /* Dummy implementations */
-void B_output(struct msg message) {}
-void B_timerinterrupt(void) {}
\ No newline at end of file
+void B_output(struct msg message) {}
\ No newline at end of file
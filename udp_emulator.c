@@ -0,0 +1,565 @@
+/* ********************************************************************
+   UDP LOOPBACK BACKEND FOR THE GO-BACK-N AND SELECTIVE REPEAT PRACTICAL
+
+   This file replaces emulator.c when linked with gbn.c or sr.c:
+       gcc udp_emulator.c gbn.c -o gbn_udp
+       gcc udp_emulator.c sr.c -o sr_udp
+   It implements tolayer3(), tolayer5(), starttimer() and stoptimer() with
+   real system calls, so the unmodified protocol code can be measured
+   against real sockets and timers instead of the simulated ones.
+
+   - entity A and entity B each own a UDP socket bound to 127.0.0.1.
+   Packets are queued by tolayer3() and flushed with one sendmmsg() per
+   socket per loop iteration; arrivals are read with recvmmsg().
+   - every flow and entity has its own timerfd, messages from layer 5 are
+   paced by one more timerfd.  All descriptors are waited on with epoll.
+   - one time unit of the protocols (RTT, message spacing) is TIMEUNIT_US
+   microseconds of wall-clock time.
+   - an optional impairment shim drops or corrupts packets before they
+   are sent, with the same probabilities and corruption patterns as the
+   emulator.  The loopback itself neither reorders nor delays packets.
+   - the run ends once every message has been generated and no packet
+   has been sent or received for IDLE_US microseconds.
+
+   Linux only (epoll, timerfd, sendmmsg, recvmmsg).
+   ********************************************************************* */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "emulator.h"
+#include "gbn.h"
+
+#ifndef TIMEUNIT_US
+#define TIMEUNIT_US 1000       /* microseconds per protocol time unit */
+#endif
+#ifndef IDLE_US
+#define IDLE_US     200000     /* quiet period that ends the run */
+#endif
+#define BATCH       64         /* packets per sendmmsg/recvmmsg call */
+#define MAXPENDING  64         /* accepted but undelivered messages tracked per flow */
+
+/* epoll tags for the descriptors that are not timers */
+#define TAG_SOCKET  0x100000000ULL
+#define TAG_ARRIVAL 0x200000000ULL
+
+int TRACE = 0;
+int nflows = 1;           /* number of A/B pairs sharing the sockets */
+SIMLOCAL int curflow = 0; /* flow of the entity currently being called */
+
+/* statistics updated by GBN */
+SIMLOCAL int window_full;   /* count of the number of messages dropped due to full window */
+SIMLOCAL int total_ACKs_received;
+SIMLOCAL int packets_resent;       /* count of the number of packets resent  */
+SIMLOCAL int new_ACKs;           /* count of the number of acks correctly received */
+SIMLOCAL int packets_received;  /* count of the packets received by receiver */
+SIMLOCAL int parity_sent;       /* FEC: parity packets sent by A */
+SIMLOCAL int fec_recovered;     /* FEC: packets B rebuilt from parity */
+SIMLOCAL int naks_sent;         /* NAK packets sent by B */
+SIMLOCAL int gaps_filled;       /* holes in B's window that were filled, */
+SIMLOCAL double gap_time;       /* and the time from seeing each to filling it */
+
+/* current state kept up to date by the protocols, summed over flows */
+SIMLOCAL int window_occupancy;   /* packets sent by A and not yet ACKed */
+SIMLOCAL int receiver_buffered;  /* out of order packets held by B */
+
+/* statistics updated by the backend */
+static int messages_delivered;
+static long packets_sent;
+static long packets_recvd;
+static long syscalls_send;
+static long syscalls_recv;
+
+static int nsim = 0;              /* number of messages from 5 to 4 so far */
+static int nsimmax = 0;           /* number of msgs per flow to generate, then stop */
+static float lossprob;            /* probability that a packet is dropped  */
+static float corruptprob;   /* probability that one bit is packet is flipped */
+static int corruptdirection; /* A->B A<-B or bidirectional corruption/loss */
+static float lambda;        /* arrival rate of messages from layer 5 */
+static int nlost;                 /* number dropped by the shim */
+static int ncorrupt;              /* number corrupted by the shim */
+
+/* what travels in a datagram: the flow it belongs to and the packet */
+struct wirepkt {
+  int flow;
+  struct pkt pkt;
+};
+
+/* packets waiting for the next sendmmsg() on one socket */
+struct sendqueue {
+  struct wirepkt pkts[BATCH];
+  struct iovec iov[BATCH];
+  struct mmsghdr msgs[BATCH];
+  int count;
+};
+
+struct flow {
+  int nsim;                      /* number of messages from 5 to 4 so far */
+  double nextarrival;            /* time of the next message from layer 5 */
+  double gentime[MAXPENDING];    /* generation times of messages in flight */
+  int pendfirst, pendcount;      /* ring buffer of gentime */
+};
+
+static int sock[2];               /* UDP socket of entity A and of entity B */
+static struct sendqueue sendq[2];
+static int *timerfds;             /* timerfd per flow and entity */
+static char *timeron;             /* whether that timer is armed */
+static int ntimerson;
+static int arrivalfd;             /* paces messages from layer 5 */
+static int epfd;
+static struct flow *flows;
+static int flowsdone;             /* flows that have generated nsimmax messages */
+
+static struct timespec starttime;
+static double lastactivity;       /* time of the last packet or message */
+static double latsum, latmax;     /* delivery latency in time units */
+static int latcount;
+
+double jimsrand(void)
+{
+  double mmm = RAND_MAX;
+  double x;
+  x = rand()/mmm;            /* x should be uniform in [0,1] */
+  if (TRACE > 3)
+    printf("RANDOM NUMBER GENERAION CALLED: %f\n", x);
+  return(x);
+}
+
+/* wall-clock time since the start of the run, in protocol time units */
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((ts.tv_sec - starttime.tv_sec) * 1e6 +
+          (ts.tv_nsec - starttime.tv_nsec) / 1e3) / TIMEUNIT_US;
+}
+
+static void fatal(const char *what)
+{
+  perror(what);
+  exit(EXIT_FAILURE);
+}
+
+/* arm (or, with a zero interval, disarm) a timerfd */
+static void settimerfd(int fd, double units)
+{
+  struct itimerspec its;
+  long long ns = (long long)(units * TIMEUNIT_US * 1000.0);
+
+  memset(&its, 0, sizeof(its));
+  if (units > 0.0 && ns <= 0)
+    ns = 1;                          /* zero would disarm the timer */
+  its.it_value.tv_sec = ns / 1000000000LL;
+  its.it_value.tv_nsec = ns % 1000000000LL;
+  if (timerfd_settime(fd, 0, &its, NULL) < 0)
+    fatal("timerfd_settime");
+}
+
+static void watch(int fd, uint64_t tag)
+{
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN;
+  ev.data.u64 = tag;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    fatal("epoll_ctl");
+}
+
+static void flush(int AorB)
+{
+  struct sendqueue *q = &sendq[AorB];
+  int sent = 0, n;
+
+  while (sent < q->count) {
+    n = sendmmsg(sock[AorB], q->msgs + sent, q->count - sent, 0);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fatal("sendmmsg");
+    }
+    sent += n;
+    syscalls_send++;
+  }
+  packets_sent += q->count;
+  q->count = 0;
+}
+
+/********************** Student-callable ROUTINES ***********************/
+
+void stoptimer(int AorB)
+{
+  int t = 2*curflow + AorB;
+
+  if (TRACE>1)
+    printf("          STOP TIMER: stopping timer at %f\n",now());
+  if (!timeron[t]) {
+    printf("Warning: unable to cancel your timer. It wasn't running.\n");
+    return;
+  }
+  settimerfd(timerfds[t], 0.0);
+  timeron[t] = 0;
+  ntimerson--;
+}
+
+void starttimer_ticks(int AorB, simtime_t increment)
+{
+  int t = 2*curflow + AorB;
+
+  if (TRACE>1)
+    printf("          START TIMER: starting timer at %f\n",now());
+  if (timeron[t]) {
+    printf("Warning: attempt to start a timer that is already started\n");
+    return;
+  }
+  settimerfd(timerfds[t], TICKS_TO_UNITS(increment));
+  timeron[t] = 1;
+  ntimerson++;
+}
+
+void starttimer(int AorB, double increment)
+{
+  starttimer_ticks(AorB, UNITS_TO_TICKS(increment));
+}
+
+simtime_t get_sim_ticks(void)
+{
+  return UNITS_TO_TICKS(now());
+}
+
+void tolayer3(int AorB, struct pkt packet)
+{
+  struct sendqueue *q = &sendq[AorB];
+  struct wirepkt *w;
+  double x;
+  int impaired = !(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B);
+
+  /* impairment shim: lose or corrupt the packet before it is sent */
+  if (impaired && lossprob > 0.0 && jimsrand() < lossprob) {
+    nlost++;
+    if (TRACE>0)
+      printf("          TOLAYER3: packet being lost\n");
+    return;
+  }
+  if (impaired && corruptprob > 0.0 && jimsrand() < corruptprob) {
+    ncorrupt++;
+    if ( (x = jimsrand()) < .75)
+      packet.payload[0]='Z';   /* corrupt payload */
+    else if (x < .875)
+      packet.seqnum = 999999;
+    else
+      packet.acknum = 999999;
+    if (TRACE>0)
+      printf("          TOLAYER3: packet being corrupted\n");
+  }
+
+  if (q->count == BATCH)
+    flush(AorB);
+  w = &q->pkts[q->count++];
+  w->flow = curflow;
+  w->pkt = packet;
+}
+
+void tolayer5(int AorB, char datasent[20])
+{
+  struct flow *fl = &flows[curflow];
+  double latency;
+  int i;
+
+  if (TRACE>2) {
+    printf("          TOLAYER5: data received by application at %c: ", AorB == A ? 'A' : 'B');
+    for (i=0; i<20; i++)
+      printf("%c",datasent[i]);
+    printf("\n");
+  }
+  messages_delivered++;
+  if (AorB == B && fl->pendcount > 0) {
+    latency = now() - fl->gentime[fl->pendfirst];
+    fl->pendfirst = (fl->pendfirst + 1) % MAXPENDING;
+    fl->pendcount--;
+    latsum += latency;
+    latcount++;
+    if (latency > latmax)
+      latmax = latency;
+  }
+}
+
+/********************** BACKEND SETUP AND MAIN LOOP ***********************/
+
+static void opensockets(void)
+{
+  struct sockaddr_in addr[2];
+  socklen_t len;
+  int i, j, size = 4 << 20;
+
+  for (i=0; i<2; i++) {
+    sock[i] = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sock[i] < 0)
+      fatal("socket");
+    setsockopt(sock[i], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(sock[i], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    memset(&addr[i], 0, sizeof(addr[i]));
+    addr[i].sin_family = AF_INET;
+    addr[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr[i].sin_port = 0;
+    if (bind(sock[i], (struct sockaddr *)&addr[i], sizeof(addr[i])) < 0)
+      fatal("bind");
+    len = sizeof(addr[i]);
+    getsockname(sock[i], (struct sockaddr *)&addr[i], &len);
+  }
+  for (i=0; i<2; i++) {
+    if (connect(sock[i], (struct sockaddr *)&addr[1-i], sizeof(addr[1-i])) < 0)
+      fatal("connect");
+    for (j=0; j<BATCH; j++) {
+      sendq[i].iov[j].iov_base = &sendq[i].pkts[j];
+      sendq[i].iov[j].iov_len = sizeof(struct wirepkt);
+      memset(&sendq[i].msgs[j], 0, sizeof(struct mmsghdr));
+      sendq[i].msgs[j].msg_hdr.msg_iov = &sendq[i].iov[j];
+      sendq[i].msgs[j].msg_hdr.msg_iovlen = 1;
+    }
+    watch(sock[i], TAG_SOCKET | i);
+  }
+}
+
+static void opentimers(void)
+{
+  int t;
+
+  timerfds = malloc(2 * nflows * sizeof(int));
+  timeron = calloc(2 * nflows, 1);
+  if (timerfds == 0 || timeron == 0) {
+    printf("memory allocation for timers failed.");
+    exit(EXIT_FAILURE);
+  }
+  for (t=0; t<2*nflows; t++) {
+    timerfds[t] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (timerfds[t] < 0)
+      fatal("timerfd_create (too many flows for the descriptor limit?)");
+    watch(timerfds[t], t);
+  }
+  arrivalfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (arrivalfd < 0)
+    fatal("timerfd_create");
+  watch(arrivalfd, TAG_ARRIVAL);
+}
+
+/* arm the arrival timer for the earliest pending message, if any */
+static void nextarrival(void)
+{
+  double first = -1.0, t = now();
+  int i;
+
+  for (i=0; i<nflows; i++)
+    if (flows[i].nsim < nsimmax && (first < 0.0 || flows[i].nextarrival < first))
+      first = flows[i].nextarrival;
+  if (first >= 0.0)
+    settimerfd(arrivalfd, first > t ? first - t : 1e-9);
+}
+
+/* hand every message that is due to layer 4 */
+static void arrivals(void)
+{
+  struct msg msg2give;
+  struct flow *fl;
+  double t = now();
+  int i, dropped;
+
+  for (curflow=0; curflow<nflows; curflow++) {
+    fl = &flows[curflow];
+    while (fl->nsim < nsimmax && fl->nextarrival <= t) {
+      for (i=0; i<20; i++)
+        msg2give.data[i] = 97 + fl->nsim % 26;
+      nsim++;
+      fl->nsim++;
+      dropped = window_full;
+      A_output(msg2give);
+      if (window_full == dropped && fl->pendcount < MAXPENDING) {
+        fl->gentime[(fl->pendfirst + fl->pendcount) % MAXPENDING] = t;
+        fl->pendcount++;
+      }
+      fl->nextarrival += lambda*jimsrand()*2;  /* uniform on [0,2*lambda] */
+      if (fl->nsim == nsimmax)
+        flowsdone++;
+    }
+  }
+  lastactivity = t;
+  nextarrival();
+}
+
+static void receive(int AorB)
+{
+  struct wirepkt pkts[BATCH];
+  struct iovec iov[BATCH];
+  struct mmsghdr msgs[BATCH];
+  int i, n;
+
+  for (i=0; i<BATCH; i++) {
+    iov[i].iov_base = &pkts[i];
+    iov[i].iov_len = sizeof(struct wirepkt);
+    memset(&msgs[i], 0, sizeof(struct mmsghdr));
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  for (;;) {
+    n = recvmmsg(sock[AorB], msgs, BATCH, 0, NULL);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      if (errno == EINTR)
+        continue;
+      fatal("recvmmsg");
+    }
+    syscalls_recv++;
+    packets_recvd += n;
+    lastactivity = now();
+    for (i=0; i<n; i++) {
+      if (msgs[i].msg_len != sizeof(struct wirepkt) ||
+          pkts[i].flow < 0 || pkts[i].flow >= nflows)
+        continue;
+      curflow = pkts[i].flow;
+      if (AorB == A)
+        A_input(pkts[i].pkt);
+      else
+        B_input(pkts[i].pkt);
+    }
+    if (n < BATCH)
+      break;                    /* the socket is drained */
+  }
+}
+
+static void timeout(int t)
+{
+  uint64_t expirations;
+
+  /* the timer may have been stopped by a handler earlier in this batch */
+  if (read(timerfds[t], &expirations, sizeof(expirations)) != sizeof(expirations))
+    return;
+  if (!timeron[t])
+    return;
+  timeron[t] = 0;
+  ntimerson--;
+  curflow = t / 2;
+  if (t % 2 == A)
+    A_timerinterrupt();
+  else
+    B_timerinterrupt();
+}
+
+static void init(void)
+{
+  int i;
+
+  printf("-----  UDP Loopback Network Backend -------- \n\n");
+  printf("Enter the number of messages to simulate: ");
+  scanf("%d",&nsimmax);
+  printf("Enter  packet loss probability [enter 0.0 for no loss]:");
+  scanf("%f",&lossprob);
+  printf("Enter packet corruption probability [0.0 for no corruption]:");
+  scanf("%f",&corruptprob);
+  if (lossprob != 0.0 || corruptprob != 0.0) {
+    printf("If you want loss or corruption to only occur in one direction, choose the direction: 0 A->B, 1 A<-B, 2 A<->B (both directions) :");
+    scanf("%d",&corruptdirection);
+  }
+  printf("Enter average time between messages from sender's layer5 [ > 0.0]:");
+  scanf("%f",&lambda);
+  printf("Enter TRACE:");
+  scanf("%d",&TRACE);
+  printf("Enter the number of flows sharing the channel [1 for a single A/B pair]:");
+  scanf("%d",&nflows);
+  if (nflows < 1)
+    nflows = 1;
+
+  srand(9999);
+  flows = calloc(nflows, sizeof(struct flow));
+  if (flows == 0) {
+    printf("memory allocation for flows failed.");
+    exit(EXIT_FAILURE);
+  }
+
+  epfd = epoll_create1(0);
+  if (epfd < 0)
+    fatal("epoll_create1");
+  opensockets();
+  opentimers();
+
+  clock_gettime(CLOCK_MONOTONIC, &starttime);
+  for (i=0; i<nflows; i++)
+    flows[i].nextarrival = lambda*jimsrand()*2;
+  if (nsimmax > 0)
+    nextarrival();
+  else
+    flowsdone = nflows;
+}
+
+int main(void)
+{
+  struct epoll_event events[BATCH];
+  uint64_t tag, expirations;
+  double elapsed;
+  int i, n;
+
+  init();
+  A_init();
+  B_init();
+
+  while (1) {
+    n = epoll_wait(epfd, events, BATCH, IDLE_US / 1000);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      fatal("epoll_wait");
+    }
+    for (i=0; i<n; i++) {
+      tag = events[i].data.u64;
+      if (tag & TAG_SOCKET)
+        receive((int)(tag & 1));
+      else if (tag & TAG_ARRIVAL) {
+        if (read(arrivalfd, &expirations, sizeof(expirations)) == sizeof(expirations))
+          arrivals();
+      }
+      else
+        timeout((int)tag);
+    }
+    if (sendq[A].count > 0 || sendq[B].count > 0)
+      lastactivity = now();
+    flush(A);
+    flush(B);
+    if (flowsdone == nflows && now() - lastactivity > IDLE_US / (double)TIMEUNIT_US)
+      break;
+  }
+
+  /* the idle period is not part of the measurement */
+  elapsed = lastactivity * TIMEUNIT_US / 1e6;
+  printf(" Backend stopped after %f s of wall-clock time\n after attempting to send %d msgs from layer5\n", elapsed, nsim);
+  printf("number of messages dropped due to full window:  %d \n", window_full);
+  printf("number of valid (not corrupt or duplicate) acknowledgements received at A:  %d \n", new_ACKs);
+  printf("number of packet resends by A:  %d \n", packets_resent);
+  printf("number of correct packets received at B:  %d \n", packets_received);
+  printf("number of messages delivered to application:  %d \n", messages_delivered);
+  printf("packets lost / corrupted by the shim:  %d / %d \n", nlost, ncorrupt);
+  if (parity_sent > 0)
+    printf("parity packets sent by A:  %d, packets rebuilt from parity at B:  %d \n",
+           parity_sent, fec_recovered);
+  if (gaps_filled > 0)
+    printf("holes filled in B's window:  %d, mean time to fill one:  %f, NAKs sent by B:  %d \n",
+           gaps_filled, gap_time / gaps_filled, naks_sent);
+  printf("packets sent: %ld in %ld sendmmsg calls, received: %ld in %ld recvmmsg calls\n",
+         packets_sent, syscalls_send, packets_recvd, syscalls_recv);
+  printf("messages delivered per second:  %f \n", messages_delivered / elapsed);
+  printf("packets sent per second:  %f \n", packets_sent / elapsed);
+  printf("mean delivery latency:  %f us, max delivery latency:  %f us \n",
+         latcount ? latsum / latcount * TIMEUNIT_US : 0.0,
+         latmax * TIMEUNIT_US);
+  if (ntimerson > 0)
+    printf("(note: %d timers were still running when the backend went idle)\n", ntimerson);
+  return EXIT_SUCCESS;
+}